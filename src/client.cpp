@@ -128,6 +128,7 @@ popUp()
   if (_M_RequireResync) 
     parent().requireSync();
 
+  parent().synchronized();
   endDialog();
   lc.info("end fullsync");
 }
@@ -0,0 +1,368 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "connection.h"
+#include "compress.h"
+#include "metrics.h"
+#include "nmstl/ntime"
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+using namespace nmstl;
+
+
+enum {
+  // payloads compressed by compress2
+  min_single_size = 1024,
+
+  // payloads compressed by the stream
+  min_stream_size = 64,
+
+  // larger payloads could exceed the 16 bit length of old peers
+  max_stream_size = 60000,
+
+  // incompressible transfers compress every probe_interval'th block
+  probe_interval = 16,
+
+  // the data sampled, before a transfer is judged
+  min_sample_size = 64 * 1024,
+
+  // compressions shorter than this are too noisy to be timed
+  min_timed_size = 4096
+};
+
+
+MessageCompressor::
+MessageCompressor()
+  : _M_Streaming(false), _M_PeerStarted(false), _M_Failed(false),
+    _M_LongFrames(false),
+    _M_Deflating(false), _M_Inflating(false),
+    _M_Level(0), _M_Throughput(0)
+{
+}
+
+MessageCompressor::
+~MessageCompressor()
+{
+  reset();
+}
+
+const char*
+MessageCompressor::
+capability()
+{
+  return "zstream";
+}
+
+bool MessageCompressor::
+announced(constbuf start)
+{
+  return hasCapability(start, capability());
+}
+
+void MessageCompressor::
+reset()
+{
+  if (_M_Deflating)
+    deflateEnd(&_M_Deflate);
+
+  if (_M_Inflating)
+    inflateEnd(&_M_Inflate);
+
+  _M_Streaming = _M_LongFrames = _M_Deflating = _M_Inflating = false;
+  _M_PeerStarted = _M_Failed = false;
+  _M_Level = 0;
+  _M_Throughput = 0;
+  _M_Transfers.clear();
+  _M_OutBuffer.clear();
+  _M_InBuffer.clear();
+}
+
+bool MessageCompressor::
+compress(int level, fex_header& head, constbuf& payload)
+{
+  Transfer* t = transfer(head);
+  if (level <= 0 || ! _M_PeerStarted || _M_Failed)
+    return false;
+
+  if (t && t->incompressible && t->blocks++ % probe_interval)
+    return false;
+
+  size_t in   = payload.length();
+  ntime start = ntime::now();
+
+  bool compressed = _M_Streaming
+    ? compressStream(level, head, payload)
+    : compressSingle(level, head, payload);
+
+  if (t && in > min_single_size)
+    sample(*t, in, compressed ? payload.length() : in);
+
+  Metrics::get().compressed(in, compressed ? payload.length() : in);
+
+  if (! compressed)
+    return false;
+
+  if (in >= min_timed_size) {
+    long long usecs = (ntime::now() - start).to_usecs();
+    size_t speed = in * 1000000LL / max(usecs, 1LL);
+    _M_Throughput = _M_Throughput ? (_M_Throughput * 3 + speed) / 4 : speed;
+  }
+
+  return true;
+}
+
+bool MessageCompressor::
+decompress(fex_header& head, constbuf& payload, int& error)
+{
+  error = Z_OK;
+
+  if (head.type == ME_Start) {
+    // both sides switch to streams, after receiving the peer's start
+    if (announced(payload))
+      _M_Streaming = true;
+
+    _M_LongFrames = hasCapability(payload, "frames");
+    _M_PeerStarted = true;
+
+    return false;
+  }
+
+  if (! (head.type & COMPRESS_BIT))
+    return false;
+
+  if (_M_Streaming)
+    return decompressStream(head, payload, error);
+
+  return decompressSingle(head, payload, error);
+}
+
+MessageCompressor::Transfer*
+MessageCompressor::
+transfer(const fex_header& head)
+{
+  long long wp  = (long long)head.wp_id << 8;
+  long long key = wp | head.type;
+
+  switch(head.type) {
+  case ME_RsyncSigBlock:
+  case ME_RsyncDeltaBlock:
+    return &_M_Transfers[key];
+
+  case ME_RsyncSigEnd:
+    _M_Transfers.erase(wp | ME_RsyncSigBlock);
+    break;
+
+  case ME_RsyncDeltaEnd:
+  case ME_RsyncAbort:
+    _M_Transfers.erase(wp | ME_RsyncSigBlock);
+    _M_Transfers.erase(wp | ME_RsyncDeltaBlock);
+    break;
+  }
+
+  return NULL;
+}
+
+void MessageCompressor::
+sample(Transfer& t, size_t in, size_t out)
+{
+  t.in  += in;
+  t.out += out;
+  if (t.in < min_sample_size)
+    return;
+
+  // less than 5% saved is not worth the cpu
+  t.incompressible = t.out * 100 > t.in * 95;
+
+  // forget old samples, a tarball may contain text files too
+  if (t.in > 16 * min_sample_size) {
+    t.in  /= 2;
+    t.out /= 2;
+  }
+}
+
+bool MessageCompressor::
+compressSingle(int level, fex_header& head, constbuf& payload)
+{
+  if (payload.length() <= min_single_size)
+    return false;
+
+  uLongf size = compressBound(payload.length());
+  _M_OutBuffer.resize(size + sizeof(size_t));
+  char *pbuf = &_M_OutBuffer.front();
+
+  *(size_t*)pbuf = payload.length();
+
+  int result = compress2((Bytef*)pbuf + sizeof(uLongf),
+			 &size,
+			 (const Bytef*)payload.data(),
+			 payload.length(),
+			 level);
+
+  if (result != Z_OK || size + sizeof(size_t) >= payload.length())
+    return false;
+
+  head.type |= COMPRESS_BIT;
+  payload = constbuf(pbuf, size + sizeof(size_t));
+  return true;
+}
+
+bool MessageCompressor::
+decompressSingle(fex_header& head, constbuf& payload, int& error)
+{
+  head.type &= ~COMPRESS_BIT;
+  size_t size = *(size_t*)payload.data();
+  _M_InBuffer.resize(size);
+
+  error = uncompress((Bytef*)&_M_InBuffer.front(),
+		     (uLongf*)&size,
+		     (const Bytef*)(payload.data() + sizeof(uLongf)),
+		     payload.length() - sizeof(uLongf));
+  if (error != Z_OK)
+    return false;
+
+  payload = constbuf(&_M_InBuffer.front(), _M_InBuffer.size());
+  head.length = payload.length();
+  return true;
+}
+
+bool MessageCompressor::
+compressStream(int level, fex_header& head, constbuf& payload)
+{
+  if (payload.length() < min_stream_size
+      || (payload.length() > max_stream_size && ! _M_LongFrames))
+    return false;
+
+  if (! _M_Deflating) {
+    memset(&_M_Deflate, 0, sizeof(_M_Deflate));
+    if (deflateInit(&_M_Deflate, level) != Z_OK)
+      return false;
+
+    _M_Deflating = true;
+    _M_Level = level;
+  }
+
+  // a sync flush needs some bytes more than deflateBound
+  size_t bound = deflateBound(&_M_Deflate, payload.length()) + 16;
+
+  // the input must not reach the stream unless its output is sent
+  if (bound >= fex_header::long_length && ! _M_LongFrames)
+    return false;
+
+  _M_OutBuffer.resize(bound);
+
+  _M_Deflate.next_in   = (Bytef*)payload.data();
+  _M_Deflate.avail_in  = payload.length();
+  _M_Deflate.next_out  = (Bytef*)&_M_OutBuffer.front();
+  _M_Deflate.avail_out = _M_OutBuffer.size();
+
+  if (level != _M_Level) {
+    // the previous message was flushed, the level can change
+    deflateParams(&_M_Deflate, level, Z_DEFAULT_STRATEGY);
+    _M_Level = level;
+  }
+
+  int result;
+  do {
+    if (_M_Deflate.avail_out == 0) {
+      size_t used = _M_OutBuffer.size();
+      _M_OutBuffer.resize(used * 2);
+      _M_Deflate.next_out  = (Bytef*)&_M_OutBuffer.front() + used;
+      _M_Deflate.avail_out = _M_OutBuffer.size() - used;
+    }
+
+    result = deflate(&_M_Deflate, Z_SYNC_FLUSH);
+  } while(result == Z_OK && _M_Deflate.avail_out == 0);
+
+  if (result != Z_OK) {
+    // the input is lost for the stream of the peer
+    _M_Failed = true;
+    return false;
+  }
+
+  size_t size = _M_OutBuffer.size() - _M_Deflate.avail_out;
+
+  head.type |= COMPRESS_BIT;
+  payload = constbuf(&_M_OutBuffer.front(), size);
+  return true;
+}
+
+bool MessageCompressor::
+decompressStream(fex_header& head, constbuf& payload, int& error)
+{
+  head.type &= ~COMPRESS_BIT;
+
+  if (! _M_Inflating) {
+    memset(&_M_Inflate, 0, sizeof(_M_Inflate));
+    error = inflateInit(&_M_Inflate);
+    if (error != Z_OK)
+      return false;
+
+    _M_Inflating = true;
+  }
+
+  /*
+    No message is larger than a frame. The buffer may grow one byte
+    beyond, so a full buffer always means the message is too large,
+    and a message of exactly MAX_FRAME_SIZE bytes passes.
+  */
+  const size_t limit = MAX_FRAME_SIZE + 1;
+
+  _M_InBuffer.resize(min(max((size_t)payload.length() * 4, MAX_COPY_SIZE),
+			 limit));
+
+  _M_Inflate.next_in   = (Bytef*)payload.data();
+  _M_Inflate.avail_in  = payload.length();
+  _M_Inflate.next_out  = (Bytef*)&_M_InBuffer.front();
+  _M_Inflate.avail_out = _M_InBuffer.size();
+
+  // the sender flushed, so the whole message is available at once
+  for(;;) {
+    error = inflate(&_M_Inflate, Z_SYNC_FLUSH);
+    if (error != Z_OK && error != Z_BUF_ERROR)
+      return false;
+
+    if (_M_Inflate.avail_out != 0)
+      break;
+
+    size_t used = _M_InBuffer.size();
+    if (used >= limit) {
+      error = Z_DATA_ERROR;
+      return false;
+    }
+
+    _M_InBuffer.resize(min(used * 2, limit));
+    _M_Inflate.next_out  = (Bytef*)&_M_InBuffer.front() + used;
+    _M_Inflate.avail_out = _M_InBuffer.size() - used;
+  }
+
+  if (_M_Inflate.avail_in != 0) {
+    error = Z_DATA_ERROR;
+    return false;
+  }
+
+  error = Z_OK;
+  payload = constbuf(&_M_InBuffer.front(),
+		     _M_InBuffer.size() - _M_Inflate.avail_out);
+  head.length = payload.length();
+  return true;
+}
@@ -0,0 +1,147 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "nmstl/io"
+#include <vector>
+#include <map>
+#include <zlib.h>
+
+struct fex_header;
+
+
+/*
+  Compression of message payloads (see COMPRESS_BIT) for one
+  connection. Old peers get each payload compressed on its own by
+  compress2. If both peers announce the capability in ME_Start, every
+  direction uses one deflate stream for the whole connection, which is
+  flushed at the end of each message. Thereby the dictionary survives
+  from message to message and even small payloads shrink.
+
+  File data (rsync signatures and deltas) is sampled per transfer:
+  if it does not shrink, only every probe_interval'th block is
+  compressed until the transfer ends or the data becomes
+  compressible again.
+
+  Nothing is compressed before the ME_Start of the peer arrived, so
+  both sides agree on the kind of compression: the peer switches on
+  our ME_Start, which precedes our first compressed message.
+*/
+class MessageCompressor
+{
+public:
+  MessageCompressor();
+  ~MessageCompressor();
+
+  // the token appended to the version string of ME_Start
+  static const char*
+  capability();
+
+  static bool
+  announced(nmstl::constbuf start);
+
+  void
+  reset();
+
+  bool
+  streaming() const
+  { return _M_Streaming; }
+
+  // true if the deflate stream broke, the connection must be closed
+  bool
+  failed() const
+  { return _M_Failed; }
+
+  // compressed input bytes per second, 0 if not measured yet
+  size_t
+  throughput() const
+  { return _M_Throughput; }
+
+  /*
+    Both functions return false if payload was left untouched,
+    otherwise payload points into an internal buffer (valid until the
+    next call of the same function) and head is adjusted.
+  */
+  bool
+  compress(int level, fex_header& head, nmstl::constbuf& payload);
+
+  bool
+  decompress(fex_header& head, nmstl::constbuf& payload, int& error);
+
+private:
+  struct Transfer
+  {
+    size_t       in;
+    size_t       out;
+    unsigned int blocks;
+    bool         incompressible;
+
+    Transfer() : in(0), out(0), blocks(0), incompressible(false)
+    { }
+  };
+
+  typedef std::map<long long, Transfer> Transfer_m;
+
+  MessageCompressor(const MessageCompressor&);
+  MessageCompressor& operator=(const MessageCompressor&);
+
+  bool
+  compressSingle(int level, fex_header& head, nmstl::constbuf& payload);
+
+  bool
+  decompressSingle(fex_header& head, nmstl::constbuf& payload, int& error);
+
+  bool
+  compressStream(int level, fex_header& head, nmstl::constbuf& payload);
+
+  bool
+  decompressStream(fex_header& head, nmstl::constbuf& payload, int& error);
+
+  Transfer*
+  transfer(const fex_header& head);
+
+  void
+  sample(Transfer& transfer, size_t in, size_t out);
+
+  bool              _M_Streaming;
+  bool              _M_PeerStarted; // the ME_Start of the peer arrived
+  bool              _M_Failed;
+  bool              _M_LongFrames;
+  bool              _M_Deflating;
+  bool              _M_Inflating;
+  int               _M_Level;
+  size_t            _M_Throughput;
+  Transfer_m        _M_Transfers;
+  z_stream          _M_Deflate;
+  z_stream          _M_Inflate;
+  std::vector<char> _M_OutBuffer;
+  std::vector<char> _M_InBuffer;
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
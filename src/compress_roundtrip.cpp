@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+  A round trip check of the stream compression (make check): two
+  compressors agree on streams by their ME_Start and exchange
+  messages up to the frame size, without a connection.
+*/
+#include "logging.h"
+#include "connection.h"
+#include "compress.h"
+#include "metrics.h"
+#include <iostream>
+#include <string.h>
+
+using namespace std;
+using namespace nmstl;
+
+log4cpp::Category& lc = log4cpp::Category::getRoot();
+
+
+/*
+  The check links compress.cpp only, the rest of fexd is replaced
+  by the little it needs.
+*/
+Metrics::
+Metrics()
+{
+}
+
+Metrics::
+~Metrics()
+{
+}
+
+Metrics& Metrics::
+get()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+bool
+hasCapability(constbuf start, const char* token)
+{
+  size_t      length = strlen(token);
+  const char* end = start.data() + start.length();
+  const char* i = (const char*)memchr(start.data(), 0, start.length());
+  while(i && ++i < end) {
+    if ((size_t)(end - i) > length && strncmp(i, token, length) == 0
+	&& (i[length] == 0 || i[length] == '='))
+      return true;
+
+    i = (const char*)memchr(i, 0, end - i);
+  }
+
+  return false;
+}
+
+
+// the ME_Start of a peer with streams and long frames
+static void
+start(MessageCompressor& compressor)
+{
+  static const char payload[] = "fex\0zstream\0frames=4194304";
+
+  fex_header head;
+  head.type   = ME_Start;
+  head.wp_id  = 0;
+  head.length = sizeof(payload);
+
+  constbuf buf(payload, sizeof(payload));
+  int      error;
+  compressor.decompress(head, buf, error);
+}
+
+// true if a compressible message of size bytes passes unchanged
+static bool
+round_trip(MessageCompressor& from, MessageCompressor& to, size_t size)
+{
+  string message;
+  message.reserve(size);
+  while(message.length() < size) {
+    char line[64];
+    snprintf(line, sizeof(line), "line %lu of the message\n", 
+	     (unsigned long)message.length());
+    message += line;
+  }
+  message.resize(size);
+
+  fex_header head;
+  head.type   = ME_RsyncDeltaBlock;
+  head.wp_id  = 1;
+  head.length = size;
+
+  constbuf buf(message.data(), message.length());
+  if (! from.compress(6, head, buf))
+    return false;
+
+  string sent(buf.data(), buf.length());
+  buf = constbuf(sent.data(), sent.length());
+
+  int error;
+  if (! to.decompress(head, buf, error))
+    return false;
+
+  return head.type == ME_RsyncDeltaBlock && head.length == size
+    && string(buf.data(), buf.length()) == message;
+}
+
+static int
+check(bool ok, const char* what)
+{
+  cout << (ok ? "PASS: " : "FAIL: ") << what << endl;
+  return ok ? 0 : 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+  MessageCompressor sender;
+  MessageCompressor receiver;
+  int               failures = 0;
+
+  start(sender);
+  start(receiver);
+  failures += check(sender.streaming() && receiver.streaming(), 
+		    "streams are agreed");
+
+  failures += check(round_trip(sender, receiver, 1000), 
+		    "small message passes");
+  failures += check(round_trip(sender, receiver, MAX_FRAME_SIZE), 
+		    "message of the frame size passes");
+  failures += check(round_trip(sender, receiver, 1000), 
+		    "the stream goes on after a full frame");
+  failures += check(! round_trip(sender, receiver, MAX_FRAME_SIZE + 1), 
+		    "larger message is refused");
+
+  return failures ? 1 : 0;
+}
@@ -24,13 +24,14 @@
 #include "filelistener.h"
 #include "watchpoint.h"
 #include "serial.h"
+#include "metrics.h"
+#include "tls.h"
 #include <algorithm>
 #include <iostream>
 #include <fstream>
-#include <fnmatch.h>
 #include <assert.h>
 #include <confuse.h>
-#include <utime.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <pwd.h>
 
@@ -90,12 +91,14 @@ check_keys(const string& dir, uid_t uid)
 }
 
 
+// removes the directory name inside parent (a directory fd)
 static 
 void 
-rmtree(string& full_path)
+rmtree(int parent, const char* name)
 {
-  int length = full_path.length();
-  DIR* dirf = opendir(full_path.c_str());
+  int fd = ::openat(parent, name, 
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR* dirf = fd >= 0 ? fdopendir(fd) : NULL;
   if (dirf) {
     struct dirent *item;
 
@@ -104,24 +107,25 @@ rmtree(string& full_path)
 	  item->d_name[0] == '.' && item->d_name[1] == 0)
 	continue;
 
-      full_path.erase(length);
-      full_path += item->d_name;
-
-      struct stat buf;
-      lstat(full_path.c_str(), &buf);
-      if (S_ISDIR(buf.st_mode)) {
-	full_path += "/";
-	rmtree(full_path);
+      bool is_dir = item->d_type == DT_DIR;
+      if (item->d_type == DT_UNKNOWN) {
+	struct stat buf;
+	is_dir = fstatat(dirfd(dirf), item->d_name, &buf, 
+			 AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(buf.st_mode);
       }
+
+      if (is_dir)
+	rmtree(dirfd(dirf), item->d_name);
       else 
-	unlink(full_path.c_str());
+	unlinkat(dirfd(dirf), item->d_name, 0);
     }
 
     closedir(dirf);
   }
+  else if (fd >= 0)
+    ::close(fd);
 	
-  full_path.erase(length);
-  ::remove(full_path.c_str());
+  unlinkat(parent, name, AT_REMOVEDIR);
 }
 
 static
@@ -152,8 +156,10 @@ WatchPoint(const WatchPoint& wp) : timer(MainLoop)
   _M_Path            = wp._M_Path;
   _M_Export          = wp._M_Export;
   _M_Imports         = wp._M_Imports;
+  _M_Limit           = wp._M_Limit;
   _M_Excludes        = wp._M_Excludes;
   _M_Includes        = wp._M_Includes;
+  _M_Matcher         = wp._M_Matcher;
   _M_ImportToInspect = 0;
 }
 
@@ -163,18 +169,7 @@ isValidPath(const string& path) const
   if (path.find("/.fextmp") != string::npos)
     return false;
 
-  string_v::const_iterator i;
-  for(i = _M_Includes.begin(); i != _M_Includes.end(); i++) {
-    if (fnmatch(i->c_str(), path.c_str(), 0) == 0)
-      return true;
-  }
-
-  for(i = _M_Excludes.begin(); i != _M_Excludes.end(); i++) {
-    if (fnmatch(i->c_str(), path.c_str(), 0) == 0)
-      return false;
-  }
-
-  return true;
+  return _M_Matcher.isValid(path);
 }
 
 void WatchPoint::
@@ -183,6 +178,13 @@ change(const Path& path, const State& state)
   void* lock_id = FileListener::get().notifyChange(this, path, state);
   string p(path);
   p = p.substr(_M_Path.length());
+
+  // a change made by a peer is not replayed to this peer
+  string origin;
+  if (lock_id && _M_Sinks.count((ConnectedWatchPoint*)lock_id))
+    origin = ((ConnectedWatchPoint*)lock_id)->peer();
+  _M_Journal.record(p, state, origin);
+
   sink_set::iterator i;
   for(i = _M_Sinks.begin(); i != _M_Sinks.end(); i++) {
     (*i)->file_changed(p, (State::State&)state, lock_id);
@@ -263,34 +265,127 @@ void WatchPoint::
 remove(const string& path) const
 {
   string full_path = _M_Path + path;
-  ::remove(full_path.c_str());
-  full_path += "/";
-  rmtree(full_path);
+  if (::unlink(full_path.c_str()) < 0 && errno == EISDIR)
+    rmtree(AT_FDCWD, full_path.c_str());
 }
 
+
 void WatchPoint::
-mkdir(const string& path, State& state) const
+changeAccess(const string& path, State& state) const
 {
   string full_path = _M_Path + path;
-  if (::mkdir(full_path.c_str(), state.mode) < 0)
-    lc.error("could not mkdir %s: %s", full_path.c_str(), strerror(errno));
-  
-  changeAccess(path, state);
+  changeAccess(AT_FDCWD, full_path.c_str(), state);
 }
 
+void WatchPoint::
+changeAccess(int dir_fd, const char* name, const State& state) const
+{
+  // only the attributes which differ are changed
+  struct stat buf;
+  if (fstatat(dir_fd, name, &buf, 0) < 0) {
+    lc.error("could not change access of %s: %s", name, strerror(errno));
+    return;
+  }
+
+  // chown first, it may clear the set-id bits
+  bool chowned = false;
+  if (buf.st_uid != state.uid || buf.st_gid != state.gid) {
+    fchownat(dir_fd, name, state.uid, state.gid, 0);
+    chowned = true;
+  }
+
+  const mode_t perms = 07777;
+  if ((buf.st_mode & perms) != (state.mode & perms)
+      || chowned && (state.mode & (S_ISUID | S_ISGID)))
+    fchmodat(dir_fd, name, state.mode & perms, 0);
+
+  if (buf.st_mtime != state.mtime) {
+    struct timespec times[2];
+    times[0].tv_sec  = times[1].tv_sec  = state.mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(dir_fd, name, times, 0);
+  }
+}
 
 void WatchPoint::
-changeAccess(const string& path, State& state) const
+changeAccess(int fd, const State& state) const
 {
-  string full_path = _M_Path + path;
+  // chown first, it may clear the set-id bits
+  fchown(fd, state.uid, state.gid);
+  fchmod(fd, state.mode);
+  struct timespec times[2];
+  times[0].tv_sec  = times[1].tv_sec  = state.mtime;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  futimens(fd, times);
+}
+
 
-  chmod(full_path.c_str(), state.mode);
-  chown(full_path.c_str(), state.uid, state.gid);
-  struct utimbuf buf;
-  buf.actime = buf.modtime = state.mtime;
-  utime(full_path.c_str(), &buf);
+void AccessBatch::
+add(const string& path, const State& state, bool mkdir)
+{
+  size_t pos = path.rfind('/');
+
+  _M_Entries.push_back(entry());
+  entry& e = _M_Entries.back();
+  e.dir.assign(path, 0, pos == string::npos ? 0 : pos);
+  e.name.assign(path, pos == string::npos ? 0 : pos + 1, string::npos);
+  e.state = state;
+  e.mkdir = mkdir;
+  e.order = _M_Entries.size();
 }
 
+void AccessBatch::
+apply()
+{
+  /* 
+     A parent directory sorts before its subdirectories, so the
+     directories are still created top down.
+  */
+  sort(_M_Entries.begin(), _M_Entries.end());
+
+  string dir;
+  int    fd = -1;
+
+  vector<entry>::iterator i;
+  for(i = _M_Entries.begin(); i != _M_Entries.end(); i++) {
+    if (fd < 0 || i->dir != dir) {
+      if (fd >= 0)
+	::close(fd);
+
+      dir = i->dir;
+      string full_path = _M_WP.path() + dir + "/";
+      fd = ::open(full_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) {
+	lc.error("could not open %s: %s", full_path.c_str(), strerror(errno));
+	continue;
+      }
+    }
+
+    const char* name = i->name.c_str();
+    if (i->mkdir && mkdirat(fd, name, i->state.mode & 07777) < 0) {
+      // a directory may stay, anything else is replaced
+      struct stat buf;
+      if (errno != EEXIST 
+	  || fstatat(fd, name, &buf, AT_SYMLINK_NOFOLLOW) < 0
+	  || ! S_ISDIR(buf.st_mode)
+	  && (unlinkat(fd, name, 0) < 0 
+	      || mkdirat(fd, name, i->state.mode & 07777) < 0)) {
+	lc.error("could not mkdir %s%s/%s: %s", _M_WP.path().c_str(), 
+		 dir.c_str(), name, strerror(errno));
+	continue;
+      }
+    }
+
+    _M_WP.changeAccess(fd, name, i->state);
+  }
+
+  if (fd >= 0)
+    ::close(fd);
+
+  _M_Entries.clear();
+}
+
+
 void WatchPoint::
 validateValues()
 {
@@ -320,6 +415,44 @@ validateValues()
   mktree(_M_StateDir);
 }
 
+void WatchPoint::
+update(const WatchPoint& wp)
+{
+  _M_Readonly = wp._M_Readonly;
+  if (_M_Limit.rate() != wp._M_Limit.rate())
+    _M_Limit.set_rate(wp._M_Limit.rate());
+
+  if (_M_Export != wp._M_Export) {
+    // the clients register the new name after reconnecting
+    lc.notice("export of %s changed", _M_Path.c_str());
+    _M_Export = wp._M_Export;
+    ConnectionPool::get().drop_watch_point(this, ConnectionPool::server_side);
+  }
+
+  if (_M_Includes != wp._M_Includes || _M_Excludes != wp._M_Excludes) {
+    lc.notice("patterns of %s changed", _M_Path.c_str());
+    _M_Includes = wp._M_Includes;
+    _M_Excludes = wp._M_Excludes;
+    _M_Matcher  = wp._M_Matcher;
+
+    // find the files, which are included now (without rehashing the
+    // known ones)
+    rescan(_M_Path);
+  }
+
+  if (_M_Imports != wp._M_Imports) {
+    lc.notice("imports of %s changed", _M_Path.c_str());
+    ConnectionPool::get().drop_watch_point(this, ConnectionPool::client_side);
+    _M_Imports = wp._M_Imports;
+    _M_ImportToInspect = 0;
+
+    if (_M_Imports.empty())
+      disarm();
+    else
+      arm(ntime::now());
+  }
+}
+
 void WatchPoint::
 fire()
 {
@@ -335,8 +468,8 @@ fire()
 
     ClientConnection* con = ConnectionPool::get().get_client_connection(key);
 
-    int state = con->connect(import.ssh, import.user, import.gateway, 
-			     import.server, import.port);
+    int state = con->connect(import.ssh, import.tls, import.user,
+			     import.gateway, import.server, import.port);
 
     _M_NextTry = ntime::now_plus_secs(_M_Timeout);
       
@@ -353,7 +486,10 @@ fire()
 
     case ClientConnection::connected:
       lc.notice("connection established");
-      con->addWatchPoint(this, import.translator, import.name);
+      if (! con->addWatchPoint(this, import.translator, import.name, 
+			       key + '/' + import.name, import.rate_limit))
+	continue;
+
       _M_ImportToInspect++;
       return;
 	
@@ -414,9 +550,16 @@ Configuration::
 Configuration()
 {
   _M_Port       = "3025";
+  _M_TlsPort    = "0";
+  _M_TlsCertificate = FEX_STATE"/tls.pem";
+  _M_Threads    = 0;
+  _M_HashThreads = 0;
+  _M_RateLimit  = 0;
+  _M_Streams    = 1;
   _M_User       = "fex";
   _M_AcceptKeys = true;
   _M_CreateUser = true;
+  _M_Parsing    = NULL;
 }
 
 Configuration::
@@ -472,12 +615,14 @@ cfg_opt_t translate_opts[] = {
 static
 cfg_opt_t import_opts[] = {
   CFG_BOOL("ssh"      , cfg_false, CFGF_NONE),
+  CFG_BOOL("tls"      , cfg_false, CFGF_NONE),
   CFG_STR ("server"   , ""       , CFGF_NONE),
   CFG_STR ("gateway"  , ""       , CFGF_NONE),
   CFG_STR ("user"     , "fex"    , CFGF_NONE),
   CFG_STR ("name"     , ""       , CFGF_NONE),
   CFG_STR ("translate", ""       , CFGF_NONE),
   CFG_STR ("port"     , "3025"   , CFGF_NONE),
+  CFG_INT ("rate_limit", 0       , CFGF_NONE),
   CFG_END()
 };
 
@@ -489,6 +634,7 @@ cfg_opt_t watchpoint_opts[] = {
   CFG_STR     ("export"  , ""         , CFGF_NONE),
   CFG_STR_LIST("exclude" , ""         , CFGF_NONE),
   CFG_STR_LIST("include" , ""         , CFGF_NONE),
+  CFG_INT     ("rate_limit", 0        , CFGF_NONE),
   CFG_END()
 };
 
@@ -496,6 +642,13 @@ cfg_opt_t watchpoint_opts[] = {
 static
 cfg_opt_t opts[] = {
   CFG_STR ("port"          , "3025"         , CFGF_NONE),
+  CFG_STR ("tls_port"      , "0"            , CFGF_NONE),
+  CFG_STR ("tls_certificate", FEX_STATE"/tls.pem", CFGF_NONE),
+  CFG_STR ("metrics_socket", ""             , CFGF_NONE),
+  CFG_INT ("threads"       , 0              , CFGF_NONE),
+  CFG_INT ("hash_threads"  , 0              , CFGF_NONE),
+  CFG_INT ("rate_limit"    , 0              , CFGF_NONE),
+  CFG_INT ("streams"       , 1              , CFGF_NONE),
   CFG_STR ("ssh_command"   , "/usr/bin/ssh" , CFGF_NONE),
   CFG_STR ("ssh_user"      , "fex"          , CFGF_NONE),
   CFG_BOOL("accept_keys"   , cfg_true       , CFGF_NONE),
@@ -507,12 +660,101 @@ cfg_opt_t opts[] = {
 };
 
   
+int Configuration::
+load(const char* file, cfg_t*& cfg)
+{
+  cfg = cfg_init(opts, CFGF_NOCASE);
+
+  int ret = cfg_parse(cfg, file);
+  if (ret != CFG_SUCCESS) {
+    cfg_free(cfg);
+    cfg = NULL;
+  }
+
+  return ret;
+}
+
+void Configuration::
+read_globals(cfg_t* cfg)
+{
+  _M_Port         = cfg_getstr (cfg, "port");
+  _M_TlsPort      = cfg_getstr (cfg, "tls_port");
+  _M_TlsCertificate = cfg_getstr (cfg, "tls_certificate");
+  _M_MetricsSocket = cfg_getstr (cfg, "metrics_socket");
+  _M_Threads      = max(0l, cfg_getint(cfg, "threads"));
+  _M_HashThreads  = max(0l, cfg_getint(cfg, "hash_threads"));
+  _M_RateLimit    = max(0l, cfg_getint(cfg, "rate_limit"));
+  _M_Streams      = max(1l, cfg_getint(cfg, "streams"));
+  _M_SSHCommand   = cfg_getstr (cfg, "ssh_command");
+  _M_User         = cfg_getstr (cfg, "ssh_user");
+  _M_AcceptKeys   = cfg_getbool(cfg, "accept_keys");
+  _M_CreateUser   = cfg_getbool(cfg, "create_user");
+}
+
+WatchPoint* Configuration::
+read_watch_point(cfg_t* wp)
+{
+  WatchPoint *tmp = new WatchPoint();
+
+  tmp->_M_Path         = cfg_title  (wp);
+  tmp->_M_Export       = cfg_getstr (wp, "export");
+  tmp->_M_Readonly     = cfg_getbool(wp, "readonly");
+  tmp->_M_Limit.set_rate(max(0l, cfg_getint(wp, "rate_limit")));
+
+  size_t m = cfg_size(wp, "import");
+  for(size_t j = 0; j < m; j++) {
+    cfg_t* imp       = cfg_getnsec(wp,  "import", j);
+    string translate = cfg_getstr (imp, "translate");
+
+    WatchPoint::Import import;
+    import.ssh        = cfg_getbool(imp, "ssh");
+    import.tls        = cfg_getbool(imp, "tls");
+    import.server     = cfg_getstr (imp, "server");
+    import.user       = cfg_getstr (imp, "user");
+    import.gateway    = cfg_getstr (imp, "gateway");
+    import.name       = cfg_getstr (imp, "name");
+    import.port       = cfg_getstr (imp, "port");
+    import.rate_limit = max(0l, cfg_getint(imp, "rate_limit"));
+    import.translator = &_M_Translators[translate];
+    if (import.gateway.empty())
+      import.gateway = import.server;
+
+    tmp->_M_Imports.push_back(import);
+  }
+
+  m = cfg_size(wp, "exclude");
+  for(size_t j = 0; j < m; j++) {
+    tmp->_M_Excludes.push_back(cfg_getnstr(wp, "exclude", j));
+  }
+
+  m = cfg_size(wp, "include");
+  for(size_t j = 0; j < m; j++) {
+    tmp->_M_Includes.push_back(cfg_getnstr(wp, "include", j));
+  }
+
+  tmp->_M_Matcher.compile(tmp->_M_Includes, tmp->_M_Excludes);
+  return tmp;
+}
+
+void Configuration::
+start_watch_point(WatchPoint* wp)
+{
+  _M_WatchPoints.push_back(wp);
+  wp->validateValues();
+
+  // start monitoring the Watchpoint
+  wp->changeDB(wp->path());
+
+  if (! wp->_M_Imports.empty())
+    wp->arm(ntime::now());
+}
+  
 void Configuration::
 parse(const char* file)
 {
-  cfg_t *cfg = cfg_init(opts, CFGF_NOCASE);
+  cfg_t *cfg;
 
-  int ret = cfg_parse(cfg, file);
+  int ret = load(file, cfg);
   if(ret == CFG_FILE_ERROR) {
     perror(file);
     exit(1);
@@ -521,64 +763,123 @@ parse(const char* file)
     exit(1);
   }
 
-  _M_Port         = cfg_getstr (cfg, "port");
-  _M_SSHCommand   = cfg_getstr (cfg, "ssh_command");
-  _M_User         = cfg_getstr (cfg, "ssh_user");
-  _M_AcceptKeys   = cfg_getbool(cfg, "accept_keys");
-  _M_CreateUser   = cfg_getbool(cfg, "create_user");
+  read_globals(cfg);
 
+  size_t n = cfg_size(cfg, "watchpoint");
+  for(size_t i = 0; i < n; i++)
+    start_watch_point(read_watch_point(cfg_getnsec(cfg, "watchpoint", i)));
+
+  cfg_free(cfg);
+  check_user();
+  TlsTransport::setup(_M_TlsCertificate, FEX_STATE"/tls_trusted", 
+		      _M_AcceptKeys);
+}
+
+bool Configuration::
+reload(const char* file)
+{
+  lc.notice("reloading %s", file);
+
+  // the id translations are parsed by callbacks, they must not change
+  // the translators in use before the whole file is valid
+  IDTranslator_m translators;
+  cfg_t*         cfg;
+
+  _M_Parsing = &translators;
+  int ret = load(file, cfg);
+  _M_Parsing = NULL;
+
+  if (ret != CFG_SUCCESS) {
+    lc.error("%s is not valid, the configuration is unchanged", file);
+    return false;
+  }
+
+  string port       = _M_Port;
+  string tls_port   = _M_TlsPort;
+  string tls_cert   = _M_TlsCertificate;
+  size_t threads    = _M_Threads;
+  size_t hashers    = _M_HashThreads;
+  size_t rate_limit = _M_RateLimit;
+  string user       = _M_User;
+
+  read_globals(cfg);
+
+  if (port != _M_Port || tls_port != _M_TlsPort 
+      || tls_cert != _M_TlsCertificate || threads != _M_Threads
+      || hashers != _M_HashThreads) {
+    lc.warn("port, tls_port, tls_certificate, threads and hash_threads "
+	    "are changed after a restart only");
+    _M_Port           = port;
+    _M_TlsPort        = tls_port;
+    _M_TlsCertificate = tls_cert;
+    _M_Threads        = threads;
+    _M_HashThreads    = hashers;
+  }
+
+  if (rate_limit != _M_RateLimit)
+    ConnectionPool::get().set_rate_limit(_M_RateLimit);
+
+  Metrics::get().listen(_M_MetricsSocket);
+
+  if (user != _M_User)
+    check_user();
+
+  TlsTransport::setup(_M_TlsCertificate, FEX_STATE"/tls_trusted", 
+		      _M_AcceptKeys);
+
+  // the imports keep their translator objects, only the ids change
+  IDTranslator_m::iterator t;
+  for(t = _M_Translators.begin(); t != _M_Translators.end(); t++)
+    t->second = translators[t->first];
+  for(t = translators.begin(); t != translators.end(); t++)
+    _M_Translators[t->first] = t->second;
+
+  // the watchpoints are identified by their path
+  WatchPoint_v  kept;
+  WatchPoint_v  added;
   size_t n = cfg_size(cfg, "watchpoint");
   for(size_t i = 0; i < n; i++) {
-    WatchPoint *tmp = new WatchPoint();
-    cfg_t*     wp = cfg_getnsec(cfg, "watchpoint", i);
-
-    tmp->_M_Path         = cfg_title  (wp);
-    tmp->_M_Export       = cfg_getstr (wp, "export");
-    tmp->_M_Readonly     = cfg_getbool(wp, "readonly");
-
-    size_t m = cfg_size(wp, "import");
-    for(size_t j = 0; j < m; j++) {
-      cfg_t* imp       = cfg_getnsec(wp,  "import", j);
-      string translate = cfg_getstr (imp, "translate");
-
-      WatchPoint::Import import;
-      import.ssh        = cfg_getbool(imp, "ssh");
-      import.server     = cfg_getstr (imp, "server");
-      import.user       = cfg_getstr (imp, "user");
-      import.gateway    = cfg_getstr (imp, "gateway");
-      import.name       = cfg_getstr (imp, "name");
-      import.port       = cfg_getstr (imp, "port");
-      import.translator = &translator(translate);
-      if (import.gateway.empty())
-	import.gateway = import.server;
-
-      tmp->_M_Imports.push_back(import);
-    }
+    WatchPoint* fresh = read_watch_point(cfg_getnsec(cfg, "watchpoint", i));
 
-    m = cfg_size(wp, "exclude");
-    for(size_t j = 0; j < m; j++) {
-      tmp->_M_Excludes.push_back(cfg_getnstr(wp, "exclude", j));
+    WatchPoint_v::iterator f;
+    for(f = _M_WatchPoints.begin(); f != _M_WatchPoints.end(); f++) {
+      if ((*f)->path() == fresh->path())
+	break;
     }
 
-    m = cfg_size(wp, "include");
-    for(size_t j = 0; j < m; j++) {
-      tmp->_M_Includes.push_back(cfg_getnstr(wp, "include", j));
+    if (f == _M_WatchPoints.end() 
+	|| find(kept.begin(), kept.end(), *f) != kept.end()) {
+      added.push_back(fresh);
+      continue;
     }
 
-    _M_WatchPoints.push_back(tmp);
-    _M_WatchPoints.back()->validateValues();
+    (*f)->update(*fresh);
+    kept.push_back(*f);
+    delete fresh;
   }
 
+  cfg_free(cfg);
+
   WatchPoint_v::iterator i;
   for(i = _M_WatchPoints.begin(); i != _M_WatchPoints.end(); i++) {
-    // start monitoring the Watchpoint
-    (*i)->changeDB((*i)->path());
+    if (find(kept.begin(), kept.end(), *i) != kept.end())
+      continue;
 
-    if (! (*i)->_M_Imports.empty())
-      (*i)->arm(ntime::now());
+    lc.notice("watchpoint %s removed", (*i)->path().c_str());
+    ConnectionPool::get().drop_watch_point(*i, ConnectionPool::both_sides);
+    FileListener::get().removeWatchPoint(*i);
+    delete *i;
   }
 
-  check_user();
+  _M_WatchPoints.swap(kept);
+
+  for(i = added.begin(); i != added.end(); i++) {
+    lc.notice("watchpoint %s added", (*i)->path().c_str());
+    start_watch_point(*i);
+    FileListener::get().addWatchPoint(*i);
+  }
+
+  return true;
 }
 
 
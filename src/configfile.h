@@ -23,15 +23,20 @@
 #define CONFIGFILE_H
 
 #include "modlog.h"
+#include "ratelimit.h"
+#include "journal.h"
+#include "pathmatcher.h"
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <nmstl/ioevent>
 
 /*
 
    IDTranslator is a map for translating client user ids to server 
-   user ids and vice versa
+   user ids and vice versa. The ids are kept in sorted arrays, an
+   empty translator returns the ids unchanged without a search.
 
 */
 class IDTranslator
@@ -41,33 +46,29 @@ public:
 
   id_t 
   getServerUid(id_t client) const
-  { id_m::const_iterator f = _M_UserClientToServer.find(client);
-    return f != _M_UserClientToServer.end() ? f->second : client; }
+  { return lookup(_M_UserClientToServer, client); }
 
   id_t 
   getClientUid(id_t server) const
-  { id_m::const_iterator f = _M_UserServerToClient.find(server);
-    return f != _M_UserServerToClient.end() ? f->second : server; }
+  { return lookup(_M_UserServerToClient, server); }
 
   id_t 
   getServerGid(id_t client) const
-  { id_m::const_iterator f = _M_GroupClientToServer.find(client);
-    return f != _M_GroupClientToServer.end() ? f->second : client; }
+  { return lookup(_M_GroupClientToServer, client); }
 
   id_t 
   getClientGid(id_t server) const
-  { id_m::const_iterator f = _M_GroupServerToClient.find(server);
-    return f != _M_GroupServerToClient.end() ? f->second : server; }
+  { return lookup(_M_GroupServerToClient, server); }
 
   void
   addUid(id_t server, id_t client)
-  { _M_UserClientToServer[client] = server; 
-    _M_UserServerToClient[server] = client; }
+  { assign(_M_UserClientToServer, client, server); 
+    assign(_M_UserServerToClient, server, client); }
 
   void
   addGid(id_t server, id_t client)
-  { _M_GroupClientToServer[client] = server; 
-    _M_GroupServerToClient[server] = client; }
+  { assign(_M_GroupClientToServer, client, server); 
+    assign(_M_GroupServerToClient, server, client); }
 
   size_t
   uid_size() const
@@ -77,19 +78,53 @@ public:
   gid_size() const
   { return _M_GroupClientToServer.size(); }
 
+  // true if no id is translated
+  bool
+  identity() const
+  { return _M_UserClientToServer.empty() && _M_GroupClientToServer.empty(); }
+
+  // translates the ids of a state received from the server
+  void
+  toClient(State& state) const
+  { if (identity()) return;
+    state.uid = getClientUid(state.uid);
+    state.gid = getClientGid(state.gid); }
+
+  // translates the ids of a state sent to the server
+  void
+  toServer(State& state) const
+  { if (identity()) return;
+    state.uid = getServerUid(state.uid);
+    state.gid = getServerGid(state.gid); }
 
 private:
-  typedef std::map<id_t, id_t> id_m;
-  
-  id_m _M_UserClientToServer;
-  id_m _M_UserServerToClient;
-  id_m _M_GroupClientToServer;
-  id_m _M_GroupServerToClient;
+  typedef std::pair<id_t, id_t> id_pair;
+  typedef std::vector<id_pair>  id_v;   // sorted by the first id
+
+  static id_t
+  lookup(const id_v& ids, id_t id)
+  { if (ids.empty()) return id;
+    id_v::const_iterator f = std::lower_bound(ids.begin(), ids.end(), 
+					      id_pair(id, 0));
+    return f != ids.end() && f->first == id ? f->second : id; }
+
+  static void
+  assign(id_v& ids, id_t from, id_t to)
+  { id_v::iterator f = std::lower_bound(ids.begin(), ids.end(), 
+					id_pair(from, 0));
+    if (f != ids.end() && f->first == from) f->second = to;
+    else ids.insert(f, id_pair(from, to)); }
+
+  id_v _M_UserClientToServer;
+  id_v _M_UserServerToClient;
+  id_v _M_GroupClientToServer;
+  id_v _M_GroupServerToClient;
 };
 
 
 class ConnectedWatchPoint;
 class ClientWatchPoint;
+typedef struct cfg_t cfg_t;
 
 /*
   A WachtPoint as described in the configuration file.  It gets all
@@ -106,7 +141,15 @@ public:
     std::string   name;
     std::string   user;
     std::string   port;
+    bool          tls;
+    size_t        rate_limit;
     IDTranslator* translator;
+
+    bool operator==(const Import& i) const
+    { return (ssh == i.ssh && server == i.server && gateway == i.gateway
+	      && name == i.name && user == i.user && port == i.port
+	      && tls == i.tls && rate_limit == i.rate_limit
+	      && translator == i.translator); }
   };
 
   typedef std::vector<Import> Import_v;
@@ -124,6 +167,10 @@ public:
   virtual bool
   isValidPath(const std::string& path) const;
 
+  virtual bool
+  isExcludedTree(const std::string& dir) const
+  { return _M_Matcher.isExcludedTree(dir); }
+
   const std::string&
   path() const
   { return _M_Path; }
@@ -151,11 +198,20 @@ public:
   void
   changeAccess(const std::string& path, State& state) const;
 
+  // name is relative to the directory fd dir_fd
+  void
+  changeAccess(int dir_fd, const char* name, const State& state) const;
+
+  void
+  changeAccess(int fd, const State& state) const;
+
   void
   remove(const std::string& path) const;
 
-  void 
-  mkdir(const std::string& path, State& state) const;
+  // shared by all connections of the watchpoint
+  TokenBucket&
+  limit()
+  { return _M_Limit; }
 
   const Import_v& 
   imports() const
@@ -164,6 +220,10 @@ public:
   void
   validateValues();
 
+  // takes the reloaded configuration of the same path
+  void
+  update(const WatchPoint& wp);
+
   size_t
   createStateFile(void* id, std::string* filename) const;
 
@@ -177,6 +237,17 @@ public:
   void
   disconnect(ConnectedWatchPoint* sink)
   { _M_Sinks.erase(sink); }
+
+  ChangeJournal&
+  journal()
+  { return _M_Journal; }
+
+  typedef std::set<ConnectedWatchPoint*> sink_set;
+
+  // the connections to the peers of the watchpoint
+  const sink_set&
+  sinks() const
+  { return _M_Sinks; }
   
 
 protected:
@@ -185,8 +256,6 @@ protected:
 
 
 private:
-  typedef std::set<ConnectedWatchPoint*> sink_set;
-
   virtual void 
   fire();
 
@@ -196,10 +265,13 @@ private:
   std::string  _M_Export;
   bool         _M_Readonly;
   Import_v     _M_Imports;
+  TokenBucket  _M_Limit;
   size_t       _M_ImportToInspect;
   string_v     _M_Excludes;
   string_v     _M_Includes;
+  PathMatcher  _M_Matcher;
   sink_set     _M_Sinks;
+  ChangeJournal _M_Journal;
   nmstl::ntime _M_NextTry;
   unsigned int _M_Timeout;
   
@@ -207,6 +279,56 @@ private:
 };
 
 
+/*
+  Collects received access changes and new directories of a
+  WatchPoint and applies them directory by directory. Every directory
+  is opened once and the entries are changed relative to its fd.
+  The entries must be added in the order of the ModLog, so a new
+  directory is created before its contents.
+*/
+class AccessBatch
+{
+public:
+  AccessBatch(const WatchPoint& wp)
+    : _M_WP(wp)
+  { }
+
+  ~AccessBatch()
+  { apply(); }
+
+  void
+  changeAccess(const std::string& path, const State& state)
+  { add(path, state, false); }
+
+  void
+  mkdir(const std::string& path, const State& state)
+  { add(path, state, true); }
+
+  void
+  apply();
+
+private:
+  struct entry
+  {
+    std::string dir;   // relative to the watchpoint
+    std::string name;
+    State       state;
+    bool        mkdir;
+    size_t      order;
+
+    bool
+    operator<(const entry& e) const
+    { return dir != e.dir ? dir < e.dir : order < e.order; }
+  };
+
+  void
+  add(const std::string& path, const State& state, bool mkdir);
+
+  const WatchPoint&  _M_WP;
+  std::vector<entry> _M_Entries;
+};
+
+
 /*
   Container of all configuration entries
  */
@@ -219,6 +341,10 @@ public:
   void
   parse(const char* file);
 
+  // applies the changes of the configuration file (after SIGHUP)
+  bool
+  reload(const char* file);
+
   const WatchPoint_v&
   watch_points()
   { return _M_WatchPoints; }
@@ -235,6 +361,37 @@ public:
   port() const
   { return _M_Port; }
 
+  const std::string
+  tls_port() const
+  { return _M_TlsPort; }
+
+  const std::string&
+  tls_certificate() const
+  { return _M_TlsCertificate; }
+
+  // the unix socket of the metrics, empty if disabled
+  const std::string&
+  metrics_socket() const
+  { return _M_MetricsSocket; }
+
+  size_t
+  threads() const
+  { return _M_Threads; }
+
+  // the number of threads hashing the files found by rescans
+  size_t
+  hash_threads() const
+  { return _M_HashThreads; }
+
+  size_t
+  rate_limit() const
+  { return _M_RateLimit; }
+
+  // the number of connections to each peer
+  size_t
+  streams() const
+  { return _M_Streams; }
+
   uid_t
   find_user_id(const std::string& user) const;
 
@@ -251,7 +408,7 @@ public:
 
   IDTranslator&
   translator(const std::string& id)
-  { return _M_Translators[id]; }
+  { return _M_Parsing ? (*_M_Parsing)[id] : _M_Translators[id]; }
   
 
 private:
@@ -263,10 +420,29 @@ private:
   void
   check_user();
 
+  int
+  load(const char* file, cfg_t*& cfg);
+
+  void
+  read_globals(cfg_t* cfg);
+
+  WatchPoint*
+  read_watch_point(cfg_t* wp);
+
+  void
+  start_watch_point(WatchPoint* wp);
+
   static Configuration* _S_Configuration;
 
   WatchPoint_v   _M_WatchPoints;
   std::string    _M_Port;
+  std::string    _M_TlsPort;
+  std::string    _M_TlsCertificate;
+  std::string    _M_MetricsSocket;
+  size_t         _M_Threads;
+  size_t         _M_HashThreads;
+  size_t         _M_RateLimit;
+  size_t         _M_Streams;
   std::string    _M_User;
   std::string    _M_UserHome;
   std::string    _M_SSHKey;
@@ -274,6 +450,7 @@ private:
   bool           _M_AcceptKeys;
   bool           _M_CreateUser;
   IDTranslator_m _M_Translators;
+  IDTranslator_m* _M_Parsing; // the translators of a reload
 };
 
 
@@ -27,9 +27,14 @@
 #include "rsync.h"
 #include "filelistener.h"
 #include "serial.h"
+#include "netthread.h"
+#include "tls.h"
+#include "metrics.h"
 #include <algorithm>
 #include <fstream>
 #include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <wait.h>
 #include <zlib.h>
 
@@ -42,16 +47,179 @@ extern io_event_loop MainLoop;
 extern char* version_string;
 
 
+static const char*
+findCapability(constbuf start, const char* token)
+{
+  size_t      length = strlen(token);
+  const char* end = start.data() + start.length();
+  const char* i = (const char*)memchr(start.data(), 0, start.length());
+  while(i && ++i < end) {
+    if ((size_t)(end - i) > length && strncmp(i, token, length) == 0
+	&& (i[length] == 0 || i[length] == '='))
+      return i + length;
+
+    i = (const char*)memchr(i, 0, end - i);
+  }
+
+  return NULL;
+}
+
+bool
+hasCapability(constbuf start, const char* token)
+{
+  return findCapability(start, token) != NULL;
+}
+
+size_t
+capabilityValue(constbuf start, const char* token)
+{
+  const char* value = findCapability(start, token);
+  if (! value || *value != '=')
+    return 0;
+
+  // the payload ends with '\0'
+  return strtoul(value + 1, NULL, 10);
+}
+
+
+/***************************************************************************/
+
+void LinkEstimator::
+reset()
+{
+  _M_Sent        = 0;
+  _M_Received    = 0;
+  _M_Outstanding = false;
+  _M_Busy        = false;
+  _M_ProbeTime   = 0;
+  _M_AckTime     = 0;
+  _M_AckBytes    = 0;
+  _M_Sample      = 0;
+  fill(_M_Rates, _M_Rates + samples, 0);
+  fill(_M_Rtts, _M_Rtts + samples, 0);
+}
+
+bool LinkEstimator::
+probe_due() const
+{
+  if (_M_Outstanding)
+    return false;
+
+  // one probe per round trip, but not too many on a fast lan
+  long long interval = max(rtt(), 200000LL);
+  return ntime::now().to_usecs() - _M_ProbeTime >= interval;
+}
+
+LinkEstimator::probe
+LinkEstimator::
+next_probe(bool busy)
+{
+  _M_Outstanding = true;
+  _M_Busy        = busy;
+  _M_ProbeTime   = ntime::now().to_usecs();
+
+  probe p = { _M_ProbeTime, _M_Sent };
+  return p;
+}
+
+void LinkEstimator::
+acknowledged(const probe& ack)
+{
+  long long now = ntime::now().to_usecs();
+  _M_Outstanding = false;
+
+  size_t sample = _M_Sample++ % samples;
+  _M_Rtts[sample] = max(now - ack.usecs, 1LL);
+
+  if (_M_AckTime && now > _M_AckTime && ack.bytes >= _M_AckBytes) {
+    size_t rate = (ack.bytes - _M_AckBytes) * 1000000ULL / (now - _M_AckTime);
+
+    // without a queue the link was partly idle, and the sample is
+    // only a lower bound, which replaces nothing
+    if (_M_Busy || rate > bandwidth())
+      _M_Rates[sample] = rate;
+  }
+
+  _M_AckTime  = now;
+  _M_AckBytes = ack.bytes;
+}
+
+size_t LinkEstimator::
+bandwidth() const
+{
+  return *max_element(_M_Rates, _M_Rates + samples);
+}
+
+long long LinkEstimator::
+rtt() const
+{
+  long long result = 0;
+  for(int i = 0; i < samples; i++) {
+    if (_M_Rtts[i] && (! result || _M_Rtts[i] < result))
+      result = _M_Rtts[i];
+  }
+
+  return result;
+}
+
+size_t LinkEstimator::
+window() const
+{
+  unsigned long long bdp = (unsigned long long)bandwidth() * rtt() / 1000000;
+  if (! bdp)
+    return 0;
+
+  return max(min(bdp, 32ULL * 1024 * 1024), 64ULL * 1024);
+}
+
+
+/***************************************************************************/
+
+/*
+  Fires, when the token buckets allow the next bulk message.
+*/
+class Connection::BulkTimer : public nmstl::timer
+{
+public:
+  BulkTimer(Connection& con)
+    : timer(MainLoop), _M_Connection(con)
+  { }
+
+private:
+  virtual void
+  fire()
+  {
+    _M_Connection.flushBulk();
+    if (_M_Connection.write_bytes_pending() == 0)
+      _M_Connection.all_written();
+  }
+
+  Connection& _M_Connection;
+};
+
+
+
 Connection::
-Connection(io_event_loop& loop, iohandle ioh)
+Connection(io_event_loop& loop, iohandle ioh, bool tls)
   : parent(loop, ioh, true)
 {
   init();
-  write(fex_header(ME_Start),
-	constbuf(version_string, strlen(version_string) + 1));
+  _M_Tls      = tls;
+  _M_Accepted = true;
+
+  if (NetThread::active()) {
+    // hand the socket over to a network thread
+    nmstl::socket sock = get_socket();
+    parent::set_socket(nmstl::socket());
+    set_socket(sock, true);
+  }
+  else if (_M_Tls && ! parent::set_transport(new_transport()))
+    parent::set_socket(nmstl::socket());
+
+  write(fex_header(ME_Start), constbuf(start_payload()));
   lc.notice("got connection (%x) from: %s", 
 	    this,
-	    get_socket().getpeername().as_string().c_str());
+	    peer_name().c_str());
 }
 
 Connection::
@@ -67,7 +235,24 @@ init()
   _M_DownloadSpeed    = 0;
   _M_UploadSpeed      = 0;
   _M_CompressionLevel = 0;
-  ConnectionPool::get().add_connection();
+  _M_CompressionThroughput = 0;
+  _M_Probing          = false;
+  _M_MaxFrame         = MAX_COPY_SIZE;
+  _M_LongFrames       = false;
+  _M_Started          = false;
+  _M_WideIds          = false;
+  _M_Resume           = false;
+  _M_BulkBytes        = 0;
+  _M_BulkTimer        = new BulkTimer(*this);
+  _M_Limit.set_rate(Configuration::get().rate_limit());
+  _M_NetThread        = NULL;
+  _M_Channel          = 0;
+  _M_Posted           = 0;
+  _M_Acked            = 0;
+  _M_Blocked          = false;
+  _M_Tls              = false;
+  _M_Accepted         = false;
+  ConnectionPool::get().add_connection(this);
   set_owned(false);
 }
 
@@ -75,7 +260,11 @@ Connection::
 ~Connection()
 {
   lc.notice("Connection (%x) destroyed", this);
-  ConnectionPool::get().remove_connection();
+  ConnectionPool::get().remove_connection(this);
+  delete _M_BulkTimer;
+
+  if (_M_NetThread)
+    _M_NetThread->close(_M_Channel);
 
   WatchPoints_v::iterator i;
   for(i = _M_WatchPoints.begin(); i != _M_WatchPoints.end(); i++) {
@@ -149,29 +338,392 @@ end_messages(unsigned int remaining)
   set_socket(nmstl::socket());
 }
 
+string Connection::
+start_payload()
+{
+  // old peers only read the version string up to its '\0'
+  string payload(version_string, strlen(version_string) + 1);
+  payload += MessageCompressor::capability();
+  payload += '\0';
+  payload += "probe";
+  payload += '\0';
+  payload += "wpids";
+  payload += '\0';
+  payload += "resume";
+  payload += '\0';
+  char frames[32];
+  snprintf(frames, sizeof(frames), "frames=%lu", (unsigned long)MAX_FRAME_SIZE);
+  payload.append(frames, strlen(frames) + 1);
+  return payload;
+}
+
+nmstl::transport* 
+Connection::
+new_transport()
+{
+  if (! _M_Tls)
+    return NULL;
+
+  return new TlsTransport(_M_Accepted);
+}
+
+void Connection::
+start(constbuf buf)
+{
+  // the handshake is done, a newly trusted peer is written down here
+  if (_M_Tls)
+    TlsTransport::saveTrusted();
+
+  _M_Probing = hasCapability(buf, "probe");
+
+  size_t frame = capabilityValue(buf, "frames");
+  if (frame)
+    _M_MaxFrame = max(MAX_COPY_SIZE, min(frame, MAX_FRAME_SIZE));
+  _M_LongFrames = frame != 0;
+
+  _M_Started = true;
+  _M_WideIds = hasCapability(buf, "wpids");
+  _M_Resume = hasCapability(buf, "resume");
+  if (! _M_WideIds) {
+    // the messages of larger ids were held back for the peer's
+    // answer. Their watchpoints are rejected, the WatchPoints try
+    // again later, maybe on another stream.
+    bulk_m::iterator i = _M_Bulk.upper_bound(fex_header::long_wp_id);
+    for(; i != _M_Bulk.end(); i++) {
+      message_q::iterator j;
+      for(j = i->second.begin(); j != i->second.end(); j++)
+	_M_BulkBytes -= sizeof(j->head) + j->data.length();
+    }
+
+    _M_Bulk.erase(_M_Bulk.upper_bound(fex_header::long_wp_id), _M_Bulk.end());
+
+    size_t rejected = 0;
+    for(size_t id = fex_header::long_wp_id + 1; 
+	id < _M_WatchPoints.size(); id++) {
+      ConnectedWatchPoint* cwp = _M_WatchPoints[id];
+      _M_WatchPoints[id] = NULL;
+      if (cwp)
+	rejected++;
+      delete cwp;
+    }
+
+    if (rejected)
+      lc.error("%s cannot serve more than %i watchpoints",
+	       peer_name().c_str(), (int)fex_header::long_wp_id + 1);
+  }
+
+  flushBulk();
+}
+
+
+static bool
+is_bulk(unsigned char type)
+{
+  switch(type) {
+  case ME_FullSyncState:
+  case ME_FullSyncLog:
+  case ME_SyncLogBlock:
+  case ME_RsyncSigBlock:
+  case ME_RsyncDeltaBlock:
+    return true;
+  }
+
+  return false;
+}
+
+// may overtake the bulk data of their watchpoint. ME_ReleaseLock may
+// not, the peer must get the data written under the lock first.
+static bool
+is_urgent(unsigned char type)
+{
+  switch(type) {
+  case ME_CreateWriteLock:
+  case ME_CreateReadLock:
+  case ME_Probe:
+  case ME_ProbeAck:
+    return true;
+  }
+
+  return false;
+}
+
 bool Connection::
 write(const fex_header& head, nmstl::constbuf payload)
+{
+  if (NetThread::active() && ! _M_NetThread)
+    return false;
+
+  if (! serves_wp_id(head.wp_id))
+    // a rejected watchpoint (see start)
+    return false;
+
+  // bulk data waits in the queue of its watchpoint, and everything
+  // else of the watchpoint behind it, except new locks and probes. Wide
+  // ids wait until the peer is known to understand them.
+  bool wide = head.wp_id >= fex_header::long_wp_id && ! _M_Started;
+  if (wide || (! is_urgent(head.type) 
+	       && (is_bulk(head.type) || _M_Bulk.count(head.wp_id)))) {
+    message_q& queue = _M_Bulk[head.wp_id];
+    queue.push_back(queued_message());
+    queue.back().head = head;
+    queue.back().data.assign(payload.data(), payload.length());
+    _M_BulkBytes += sizeof(head) + payload.length();
+    flushBulk();
+    return true;
+  }
+
+  return send(head, payload);
+}
+
+void Connection::
+flushBulk()
+{
+  // the control messages never wait behind more than low_water bytes
+  size_t low_water = max(_M_Link.window(), (size_t)64 * 1024);
+  long long delay  = 0;
+  bool      sent   = true;
+
+  while(sent && ! _M_Bulk.empty() && queued() < low_water) {
+    sent = false;
+
+    // one message of each watchpoint per round
+    bulk_m::iterator i = _M_Bulk.begin();
+    bulk_m::iterator e = _M_Started
+      ? _M_Bulk.end() : _M_Bulk.lower_bound(fex_header::long_wp_id);
+
+    while(i != e && queued() < low_water) {
+      queued_message& msg = i->second.front();
+      size_t size = sizeof(msg.head) + msg.data.length();
+
+      ConnectedWatchPoint* cwp = NULL;
+      if (i->first < _M_WatchPoints.size())
+	cwp = _M_WatchPoints[i->first];
+
+      long long wait = _M_Limit.delay();
+      if (cwp) {
+	wait = max(wait, cwp->limit().delay());
+	wait = max(wait, cwp->wp()->limit().delay());
+      }
+
+      if (wait) {
+	delay = delay ? min(delay, wait) : wait;
+	i++;
+	continue;
+      }
+
+      _M_Limit.take(size);
+      if (cwp) {
+	cwp->limit().take(size);
+	cwp->wp()->limit().take(size);
+      }
+
+      send(msg.head, constbuf(msg.data));
+      _M_BulkBytes -= size;
+      sent = true;
+
+      i->second.pop_front();
+      if (i->second.empty())
+	_M_Bulk.erase(i++);
+      else
+	i++;
+    }
+  }
+
+  if (! _M_Bulk.empty() && delay)
+    _M_BulkTimer->arm(ntime::now() + ntime::usecs(delay));
+}
+
+bool Connection::
+send(const fex_header& head, nmstl::constbuf payload)
 { 
-  if (_M_CompressionLevel > 0 && payload.length() > 1024) {
-    fex_header h(head);
-    h.type |= COMPRESS_BIT;
+  _M_Link.sent(sizeof(head) + payload.length());
+  Metrics::get().message_sent(head.type, sizeof(head) + payload.length());
+  if (_M_Probing && head.type != ME_Probe && _M_Link.probe_due()) {
+    LinkEstimator::probe probe = _M_Link.next_probe(queued() > 0);
+    send(fex_header(ME_Probe), constbuf(&probe, sizeof(probe)));
+  }
 
-    uLongf size = compressBound(payload.length());
-    _M_CompressionBuffer.resize(size + sizeof(size_t));
-    char *pbuf = &_M_CompressionBuffer.front();
+  // the wp_id is encoded as the peer reads it
+  fex_header plain(head);
+  plain.wide_ids = _M_WideIds;
 
-    *(size_t*)pbuf = payload.length();
+  if (NetThread::active()) {
+    if (! _M_NetThread)
+      return false;
+
+    // compressed by the network thread
+    _M_Posted += sizeof(head) + payload.length();
+    _M_NetThread->send(_M_Channel, plain, payload, _M_CompressionLevel);
+    return true;
+  }
 
-    int result = compress2((Bytef*)pbuf + sizeof(uLongf),
-			   &size,
-			   (const Bytef*)payload.data(),
-			   payload.length(),
-			   _M_CompressionLevel);
+  fex_header h(plain);
+  if (_M_Compressor.compress(_M_CompressionLevel, h, payload))
+    return parent::write(h, payload);
 
-    if (result == Z_OK)
-      return parent::write(h, constbuf(pbuf, size + sizeof(size_t)));
+  if (_M_Compressor.failed()) {
+    lc.fatal("error in compressing buffer");
+    set_socket(tcpsocket()); // disconnect
+    return false;
+  }
+
+  return parent::write(plain, payload); 
+}
+
+size_t Connection::
+queued()
+{
+  if (NetThread::active())
+    return _M_Posted - _M_Acked;
+
+  return parent::write_bytes_pending();
+}
+
+size_t Connection::
+write_bytes_pending()
+{
+  size_t pending = queued() + _M_BulkBytes;
+
+  // keep the bandwidth delay product in flight
+  if (pending < _M_Link.window())
+    return 0;
+
+  if (pending && NetThread::active())
+    _M_Blocked = true;
+
+  return pending;
+}
+
+bool Connection::
+write_blocked(WriteWaiter* waiter)
+{
+  if (! write_bytes_pending())
+    return false;
+
+  if (! waiter->_M_Waiting) {
+    waiter->_M_Waiting = true;
+    _M_Waiters.push_back(waiter);
+  }
+
+  return true;
+}
+
+void Connection::
+cancel_wait(WriteWaiter* waiter)
+{
+  if (! waiter->_M_Waiting)
+    return;
+
+  waiter->_M_Waiting = false;
+  _M_Waiters.erase(find(_M_Waiters.begin(), _M_Waiters.end(), waiter));
+}
+
+void Connection::
+set_socket(nmstl::socket sock, bool established)
+{
+  // a new peer negotiates its compression and probing again
+  _M_Compressor.reset();
+  _M_Link.reset();
+  _M_Probing = false;
+  _M_MaxFrame = MAX_COPY_SIZE;
+  _M_LongFrames = false;
+  _M_Started = false;
+  _M_WideIds = false;
+  _M_Resume = false;
+  _M_CompressionLevel = 0;
+  while(! _M_Waiters.empty()) {
+    _M_Waiters.front()->_M_Waiting = false;
+    _M_Waiters.pop_front();
+  }
+  _M_Bulk.clear();
+  _M_BulkBytes = 0;
+  _M_BulkTimer->disarm();
+
+  if (! NetThread::active()) {
+    parent::set_socket(sock, established);
+    if (sock && _M_Tls && ! parent::set_transport(new_transport()))
+      parent::set_socket(nmstl::socket());
+    return;
+  }
+
+  if (_M_NetThread) {
+    _M_NetThread->close(_M_Channel);
+    _M_NetThread = NULL;
+  }
+
+  _M_Posted = _M_Acked = 0;
+  _M_Blocked = false;
+
+  if (sock) {
+    _M_PeerName  = sock.getpeername().as_string();
+    _M_NetThread = NetThread::open(this, sock, established, new_transport(),
+				   _M_Channel);
+  }
+}
+
+bool Connection::
+is_connected()
+{
+  if (NetThread::active())
+    return _M_NetThread != NULL;
+
+  return parent::is_connected();
+}
+
+string Connection::
+peer_name()
+{
+  if (NetThread::active())
+    return _M_PeerName;
+
+  return get_socket().getpeername().as_string();
+}
+
+bool Connection::
+carries(const WatchPoint* wp) const
+{
+  WatchPoints_v::const_iterator i;
+  for(i = _M_WatchPoints.begin(); i != _M_WatchPoints.end(); i++) {
+    if (*i && (*i)->wp() == wp)
+      return true;
+  }
+
+  return false;
+}
+
+size_t Connection::
+watchpoint_count() const
+{
+  return (_M_WatchPoints.size()
+	  - count(_M_WatchPoints.begin(), _M_WatchPoints.end(),
+		  (ConnectedWatchPoint*)NULL));
+}
+
+void Connection::
+channelWritten(size_t bytes, size_t throughput)
+{
+  _M_CompressionThroughput = throughput;
+  _M_Acked = bytes;
+  if (_M_Blocked && _M_Acked == _M_Posted) {
+    _M_Blocked = false;
+    all_written();
   }
-  return parent::write(head, payload); 
+}
+
+void Connection::
+channelClosed(size_t remaining, int error)
+{
+  if (error != Z_OK) {
+    lc.fatal("error in (de)compressing buffer: %i", error);
+    set_socket(tcpsocket()); // disconnect
+    return;
+  }
+
+  // the network thread already deleted the channel
+  _M_NetThread = NULL;
+  end_messages(remaining);
+  if (! is_owned())
+    delete this;
 }
 
 void Connection::
@@ -226,70 +778,134 @@ calcSpeed(const fex_header &head)
   }
 }
 
+void Connection::
+probeAcknowledged(const LinkEstimator::probe& ack)
+{
+  _M_Link.acknowledged(ack);
+
+  size_t speed = _M_Link.bandwidth();
+  if (speed < (_M_UploadSpeed * 8) / 10 ||
+      (_M_UploadSpeed * 12) / 10 < speed) {
+    lc.info("link to %s: %u bytes/s, rtt %u ms",
+	    peer_name().c_str(),
+	    (unsigned int)speed,
+	    (unsigned int)(_M_Link.rtt() / 1000));
+
+    int delta = speed - _M_UploadSpeed;
+    _M_UploadSpeed = speed;
+    adjustCompression(delta);
+  }
+}
+
+void Connection::
+adjustCompression(int delta)
+{
+  size_t throughput = NetThread::active()
+    ? _M_CompressionThroughput : _M_Compressor.throughput();
+
+  // the probed speed is not capped like the one of ME_AdjustSpeed,
+  // compression is off as soon as the link is faster
+  if (_M_Probing
+      ? throughput && throughput < _M_UploadSpeed && _M_CompressionLevel <= 1
+      : _M_UploadSpeed >= 1000000) {
+    _M_CompressionLevel = 0;
+    return;
+  }
+
+  int level = _M_CompressionLevel;
+  if (level == 0)
+    level = 4;
+  else if (delta > 0)
+    level++;
+  else if (level > 4)
+    level--;
+
+  // the compression must not become the bottleneck of the link
+  if (_M_CompressionLevel && throughput && throughput < 2 * _M_UploadSpeed)
+    level = _M_CompressionLevel - 1;
+
+  // no more cpu for compression, if the machine is busy anyway
+  double load;
+  long   cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (getloadavg(&load, 1) == 1 && load > max(cpus, 1L))
+    level = min(level, _M_CompressionLevel);
+
+  level = max(1, min(level, 9));
+  if (level != _M_CompressionLevel && _M_CompressionLevel)
+    lc.info("changed compression to %i", level);
+
+  _M_CompressionLevel = level;
+}
+
+bool Connection::
+accept_header(const fex_header& head)
+{
+  if (head.length <= fex_header::max_length())
+    return true;
+
+  lc.error("%s sent a message of %u bytes, disconnecting", 
+	   peer_name().c_str(), head.length);
+  set_socket(tcpsocket()); // disconnect
+  return false;
+}
+
 void Connection::
 incoming_message(const fex_header &head, constbuf buf)
 {
   if (head.type == ME_AdjustSpeed) {
+    Metrics::get().message_received(head.type, sizeof(head) + buf.length());
     int delta = *(int*)buf.data();
     _M_UploadSpeed += *(int*)buf.data();
 
-    if (_M_UploadSpeed < 1000000) {
-      if (delta > 0 || _M_CompressionLevel == 0) {
-	if (_M_CompressionLevel < 4)
-	  _M_CompressionLevel = 4;
-	else if (_M_CompressionLevel < 9) {
-	  _M_CompressionLevel++;
-	  lc.info("changed compression to %i", _M_CompressionLevel);
-	}
-      }
-      else {
-	if (_M_CompressionLevel > 4) {
-	  _M_CompressionLevel--;
-	  lc.info("changed compression to %i", _M_CompressionLevel);
-	}
-      }
-    }
-    else
-      _M_CompressionLevel = 0;
-
+    adjustCompression(delta);
     return;
   }
 
   fex_header ihead(head);
   constbuf   ibuf(buf);
+  int        result;
 
-  if (ihead.type & COMPRESS_BIT) {
-    ihead.type &= ~COMPRESS_BIT;
-    size_t size = *(size_t*)buf.data();
-    _M_CompressionBuffer.resize(size);
-
-    int result = 
-      uncompress((Bytef*)&_M_CompressionBuffer.front(),
-		 (uLongf*)&size,
-		 (const Bytef*)(buf.data() + sizeof(uLongf)),
-		 buf.length() - sizeof(uLongf));
-    
-    if (result != Z_OK) {
-      lc.fatal("error in decompressing buffer: %i", result);
-      set_socket(tcpsocket()); // disconnect
-      return;
-    }
-
-    ibuf = constbuf(&_M_CompressionBuffer.front(),
-		    _M_CompressionBuffer.size());
-    ihead.length = ibuf.length();
+  _M_Compressor.decompress(ihead, ibuf, result);
+  if (result != Z_OK) {
+    lc.fatal("error in decompressing buffer: %i", result);
+    set_socket(tcpsocket()); // disconnect
+    return;
   }
 
-  calcSpeed(ihead);
+  _M_Link.received(sizeof(ihead) + ihead.length);
+  Metrics::get().message_received(ihead.type, sizeof(ihead) + ihead.length);
+  if (! _M_Probing)
+    calcSpeed(ihead);
 
 
   switch(ihead.type) {
+  case ME_Start:
+    start(ibuf);
+    return;
+
+  case ME_Probe:
+    if (ibuf.length() == sizeof(LinkEstimator::probe)) {
+      LinkEstimator::probe ack = 
+	_M_Link.answer(*(const LinkEstimator::probe*)ibuf.data());
+      write(fex_header(ME_ProbeAck), constbuf(&ack, sizeof(ack)));
+    }
+    return;
+
+  case ME_ProbeAck:
+    if (ibuf.length() == sizeof(LinkEstimator::probe))
+      probeAcknowledged(*(const LinkEstimator::probe*)ibuf.data());
+    return;
+
   case ME_RegisterWatchPoint:
-    registerWatchPoint(ihead.wp_id, buf);
+    registerWatchPoint(ihead.wp_id, ibuf);
     return;
 
   case ME_ClientKey:
-    Configuration::get().ssh_add_key(buf.data());
+    {
+      // ibuf may point into the inflate buffer, which has no '\0'
+      string key(ibuf.data(), ibuf.length());
+      Configuration::get().ssh_add_key(key.c_str());
+    }
     return;
   }
 
@@ -303,8 +919,14 @@ incoming_message(const fex_header &head, constbuf buf)
 void Connection::
 registerWatchPoint(size_t wp_id, constbuf buf) 
 {
+  // clients number their watchpoints densely from 0
+  if (wp_id >= MAX_WATCH_POINTS
+      || (wp_id < _M_WatchPoints.size() && _M_WatchPoints[wp_id])) {
+    write(fex_header(ME_Reject, wp_id));
+    return;
+  }
+
   _M_WatchPoints.resize(max(wp_id + 1, _M_WatchPoints.size()));
-  assert(_M_WatchPoints[wp_id] == NULL);
   
   string request = buf;
 
@@ -319,14 +941,14 @@ registerWatchPoint(size_t wp_id, constbuf buf)
       write(fex_header(ME_Accept, wp_id));
       lc.notice("Watchpoint %s accepted from %s",
 		request.c_str(),
-		get_socket().getpeername().as_string().c_str());
+		peer_name().c_str());
       return;
     }
   }
 
   lc.notice("Watchpoint %s from %s rejected",
 	    request.c_str(),
-	    get_socket().getpeername().as_string().c_str());
+	    peer_name().c_str());
 
   write(fex_header(ME_Reject, wp_id));
 }
@@ -335,15 +957,18 @@ registerWatchPoint(size_t wp_id, constbuf buf)
 void Connection::
 all_written()
 {
-  fex_header hd(ME_wavail);
-  constbuf   buf;
-  size_t     id;
+  flushBulk();
+  if (write_bytes_pending())
+    return;
 
-  WatchPoints_v::iterator i;
-  for(i = _M_WatchPoints.begin(); i != _M_WatchPoints.end(); i++) {
-    hd.wp_id = id++;
-    if (*i)
-      (*i)->incoming_message(hd, buf);
+  // wake the waiters in turn, until the connection blocks again. A
+  // waiter blocking again queues up behind the others.
+  size_t count = _M_Waiters.size();
+  while(count-- && ! _M_Waiters.empty() && ! write_bytes_pending()) {
+    WriteWaiter* waiter = _M_Waiters.front();
+    _M_Waiters.pop_front();
+    waiter->_M_Waiting = false;
+    waiter->writable();
   }
 }
 
@@ -364,6 +989,7 @@ ClientConnection::
 
 int ClientConnection::
 connect(bool ssh, 
+	bool tls,
 	const string& user, 
 	const string& gw, 
 	const string& server, 
@@ -372,6 +998,10 @@ connect(bool ssh,
   if (is_connected())
     return connected;
 
+  _M_Tls = tls;
+  if (tls && ! TlsTransport::available())
+    goto ConnectionFailed;
+
   if (ssh && _M_SSH == 0) {
     string local_port = start_ssh(user, gw, server, port);
     if (local_port.empty())
@@ -487,31 +1117,42 @@ stop_ssh()
   _M_SSH = 0;
 }
 
-void ClientConnection::
+bool ClientConnection::
 addWatchPoint(WatchPoint* wp, IDTranslator* translator, 
-	      const string& import_name)
+	      const string& import_name, const string& peer, 
+	      size_t rate_limit)
 {
   size_t index = _M_WatchPoints.size();
+  if (! serves_wp_id(index)) {
+    lc.error("%s cannot serve more than %i watchpoints",
+	     peer_name().c_str(), (int)fex_header::long_wp_id + 1);
+    return false;
+  }
+
   ClientWatchPoint* cwp = new ClientWatchPoint(MainLoop, wp, this,
-					       index, translator);
+					       index, translator,
+					       peer, rate_limit);
 
   _M_WatchPoints.push_back(cwp);
   write(fex_header(ME_RegisterWatchPoint, index), constbuf(import_name));
+  return true;
 }
 
 
 void ClientConnection::
-incoming_message(const fex_header &head, constbuf buf)
+start(constbuf buf)
 {
-  if (head.type == ME_Start) {
-    if (verifyServer(buf)) {
-      write(fex_header(ME_ClientKey), 
-	    constbuf(Configuration::get().ssh_key()));
-    }
-    return;
-  }
+  if (verifyServer(buf)) {
+    // answer only servers, which know the ME_Start of a client
+    if (MessageCompressor::announced(buf))
+      write(fex_header(ME_Start), constbuf(start_payload()));
 
-  Connection::incoming_message(head, buf);
+    write(fex_header(ME_ClientKey), 
+	  constbuf(Configuration::get().ssh_key()));
+
+    // the server knows our capabilities before the held messages
+    Connection::start(buf);
+  }
 }
 
 bool ClientConnection::
@@ -535,7 +1176,6 @@ verifyServer(constbuf buf)
 ConnectionPool::
 ConnectionPool()
 { 
-  _M_ConnectionCount = 0;
 }
 
 ConnectionPool::
@@ -555,6 +1195,14 @@ start_listening()
     acc->set_owned(false);
     // acc is owned by MainLoop!
   }
+
+  port = atoi(Configuration::get().tls_port().c_str());
+  if (port && TlsTransport::available()) {
+    typedef nmstl::tcp_acceptor<Connection, bool> Acceptor;
+    Acceptor* acc = new Acceptor(MainLoop, port, true);
+    lc.notice("server is listening for tls on port %i", port);
+    acc->set_owned(false);
+  }
 }
 
 
@@ -570,9 +1218,27 @@ get()
 ClientConnection* ConnectionPool::
 get_client_connection(const string& key)
 {
-  ClientConnection* con = _M_Clients[key];
-  if (! con) 
-    _M_Clients[key] = con = new ClientConnection(MainLoop);
+  ClientConnection_v& streams = _M_Clients[key];
+
+  // a connection, that is not established yet, is tried first. So
+  // a new stream is only opened, when all others work.
+  ClientConnection_v::iterator i;
+  for(i = streams.begin(); i != streams.end(); i++) {
+    if (! (*i)->is_connected())
+      return *i;
+  }
+
+  if (streams.size() < Configuration::get().streams()) {
+    streams.push_back(new ClientConnection(MainLoop));
+    return streams.back();
+  }
+
+  // the stream with the fewest watchpoints
+  ClientConnection* con = streams.front();
+  for(i = streams.begin(); i != streams.end(); i++) {
+    if ((*i)->watchpoint_count() < con->watchpoint_count())
+      con = *i;
+  }
 
   return con;
 }
@@ -582,26 +1248,60 @@ remove_client_connection(ClientConnection* con)
 {
   ClientConnections_m::iterator i = _M_Clients.begin();
   for(; i != _M_Clients.end(); i++) {
-    if (i->second == con) {
-      _M_Clients.erase(i);
+    ClientConnection_v& streams = i->second;
+    ClientConnection_v::iterator f = find(streams.begin(), streams.end(), con);
+    if (f != streams.end()) {
+      streams.erase(f);
+      if (streams.empty())
+	_M_Clients.erase(i);
       break;
     }
   }
 }
 
 void ConnectionPool::
-add_connection()
+add_connection(Connection* con)
 {
-  if (_M_ConnectionCount++ == 0)
+  _M_Connections.insert(con);
+  if (_M_Connections.size() == 1)
     FileListener::get().startLockPoll();
 }
   
 void ConnectionPool::
-remove_connection()
+remove_connection(Connection* con)
 {
-  if (--_M_ConnectionCount == 0)
+  assert(_M_Connections.count(con));
+
+  _M_Connections.erase(con);
+  if (_M_Connections.empty())
     FileListener::get().stopLockPoll();
+}
+
+void ConnectionPool::
+drop_watch_point(const WatchPoint* wp, int sides)
+{
+  vector<Connection*> drop;
+
+  set<Connection*>::iterator i;
+  for(i = _M_Connections.begin(); i != _M_Connections.end(); i++) {
+    int side = dynamic_cast<ClientConnection*>(*i) ? client_side : server_side;
+    if ((side & sides) && (*i)->carries(wp))
+      drop.push_back(*i);
+  }
+
+  // the other watchpoints of these connections reconnect and resume
+  vector<Connection*>::iterator d;
+  for(d = drop.begin(); d != drop.end(); d++) {
+    lc.notice("closing connection to %s", (*d)->peer_name().c_str());
+    delete *d;
+  }
+}
 
-  assert(_M_ConnectionCount >= 0);
+void ConnectionPool::
+set_rate_limit(size_t rate)
+{
+  set<Connection*>::iterator i;
+  for(i = _M_Connections.begin(); i != _M_Connections.end(); i++)
+    (*i)->set_rate_limit(rate);
 }
 
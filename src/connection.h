@@ -23,13 +23,23 @@
 #define CONNECTION_H
 
 #include "filelistener.h"
+#include "compress.h"
+#include "ratelimit.h"
 #include "nmstl/serial"
 #include "nmstl/netioevent"
 #include <fstream>
+#include <deque>
 #include <map>
+#include <set>
 
 const size_t MAX_COPY_SIZE = 1024 * 16;
 
+// the largest rsync block offered to peers supporting long frames
+const size_t MAX_FRAME_SIZE = 1024 * 1024 * 4;
+
+// the watchpoints a server accepts from one client
+const size_t MAX_WATCH_POINTS = 1 << 16;
+
 #define COMPRESS_BIT 0x80
 
 enum {
@@ -70,10 +80,17 @@ enum {
 
   ME_CreateWriteLock,
   ME_CreateReadLock,
-  ME_ReleaseLock
+  ME_ReleaseLock,
+
+  ME_Probe,         // sender measures the link
+  ME_ProbeAck,      // receiver answers a probe
+
+  ME_Resume,        // client asks to replay the missed changes
+  ME_ResumeOk,      // server replays, no full sync
+  ME_ResumeFail     // server requires a full sync
 };
 
-#ifndef NDEBUG
+// the name of a message type, NULL if unknown
 inline 
 const char*
 message_str(unsigned int type)
@@ -100,7 +117,7 @@ message_str(unsigned int type)
 
   case ME_RsyncStart   : return "ME_RsyncStart";
   case ME_RsyncAbort   : return "ME_RsyncAbort";
-  case ME_RsyncSigBlock: return "ME_RsyncSigBlock,";
+  case ME_RsyncSigBlock: return "ME_RsyncSigBlock";
   case ME_RsyncSigEnd  : return "ME_RsyncSigEnd";
 
   case ME_RsyncDeltaBlock: return "ME_RsyncDeltaBlock";
@@ -120,10 +137,16 @@ message_str(unsigned int type)
   case ME_CreateWriteLock: return "ME_CreateWriteLock";
   case ME_CreateReadLock: return "ME_CreateReadLock";
   case ME_ReleaseLock: return "ME_ReleaseLock";
+
+  case ME_Probe   : return "ME_Probe";
+  case ME_ProbeAck: return "ME_ProbeAck";
+
+  case ME_Resume    : return "ME_Resume";
+  case ME_ResumeOk  : return "ME_ResumeOk";
+  case ME_ResumeFail: return "ME_ResumeFail";
   }
-  assert(0);
+  return NULL;
 }
-#endif
 
 /*
   The head of all fex messages.
@@ -131,27 +154,190 @@ message_str(unsigned int type)
 
 struct fex_header 
 {
+  // a length field of long_length is followed by the 32 bit length,
+  // then a wp_id field of long_wp_id by the 32 bit wp_id. Peers
+  // without "wpids" know one byte ids only, long_wp_id included.
+  enum { long_length = 0xffff, long_wp_id = 0xff };
+
   unsigned char  type;
-  unsigned char  wp_id;
-  unsigned short length;
+  bool           wide_ids;    // not sent, the encoding of wp_id
+  bool           long_frames; // not sent, a read length may be escaped
+  unsigned int   wp_id;
+  unsigned int   length;
 
   fex_header() 
+    : wide_ids(true), long_frames(false)
   {}
   
   // Allow implicit construction by type only
   fex_header(unsigned char type, 
-	     unsigned char wp_id = 0,
-	     unsigned short length = 0) 
-    : type(type), wp_id(wp_id), length(length) 
+	     unsigned int wp_id = 0,
+	     unsigned int length = 0) 
+    : type(type), wide_ids(true), long_frames(false), wp_id(wp_id), 
+      length(length) 
+  { }
+
+  // the longest payload a peer may send: a frame, deflated without
+  // any gain, plus the overhead of a sync flush
+  static size_t
+  max_length()
+  { return compressBound(MAX_FRAME_SIZE) + 32; }
+
+  void
+  freeze(nmstl::oserial& out) const
+  {
+    bool long_id = wide_ids && wp_id >= long_wp_id;
+
+    out << type
+	<< (unsigned char)(long_id ? long_wp_id : wp_id)
+	<< (unsigned short)(length < long_length ? length : long_length);
+
+    if (length >= long_length)
+      out << length;
+
+    if (long_id)
+      out << wp_id;
+  }
+
+  void
+  unfreeze(nmstl::iserial& in)
+  {
+    unsigned char  short_wp_id = 0;
+    unsigned short short_length = 0;
+    in >> type >> short_wp_id >> short_length;
+    wp_id  = short_wp_id;
+    length = short_length;
+
+    // only a peer with "frames" escapes the length, for the others
+    // long_length is a length
+    if (in && long_frames && short_length == long_length)
+      in >> length;
+
+    if (in && wide_ids && short_wp_id == long_wp_id)
+      in >> wp_id;
+  }
+
+  NMSTL_SERIALIZABLE(fex_header);
+};
+
+
+/*
+  Returns true if the payload of ME_Start contains the capability
+  token. The tokens follow the version string, each one terminated
+  by '\0'.
+*/
+bool
+hasCapability(nmstl::constbuf start, const char* token);
+
+/*
+  Returns the value of a "token=value" capability, 0 if it is missing.
+*/
+size_t
+capabilityValue(nmstl::constbuf start, const char* token);
+
+
+/*
+  Estimates the bandwidth and round trip time of a link. The sender
+  stamps ME_Probe with its time and the peer answers with ME_ProbeAck,
+  which contains the bytes the peer has read so far. Like BBR the
+  bandwidth is the maximum delivery rate of the last samples, samples
+  taken without a send queue only count if they raise the estimate.
+*/
+class LinkEstimator
+{
+public:
+  struct probe
+  {
+    long long          usecs; // time stamp of the sender
+    unsigned long long bytes; // written by the sender (ME_Probe) or
+                              // read by the peer (ME_ProbeAck)
+  };
+
+  LinkEstimator()
+  { reset(); }
+
+  void
+  reset();
+
+  void
+  sent(size_t bytes)
+  { _M_Sent += bytes; }
+
+  void
+  received(size_t bytes)
+  { _M_Received += bytes; }
+
+  // the sender side
+  bool
+  probe_due() const;
+
+  probe
+  next_probe(bool busy);
+
+  void
+  acknowledged(const probe& ack);
+
+  // the receiver side
+  probe
+  answer(const probe& p) const
+  { probe a = { p.usecs, _M_Received }; return a; }
+
+  // bytes per second, 0 if unknown
+  size_t
+  bandwidth() const;
+
+  // usecs, 0 if unknown
+  long long
+  rtt() const;
+
+  // the bytes needed in flight to fill the link
+  size_t
+  window() const;
+
+private:
+  enum { samples = 8 };
+
+  unsigned long long _M_Sent;
+  unsigned long long _M_Received;
+  bool               _M_Outstanding;
+  bool               _M_Busy;
+  long long          _M_ProbeTime;
+  long long          _M_AckTime;
+  unsigned long long _M_AckBytes;
+  size_t             _M_Rates[samples];
+  long long          _M_Rtts[samples];
+  unsigned int       _M_Sample;
+};
+
+
+/*
+  Something, that waits for write space of a Connection (see
+  Connection::write_blocked).
+*/
+class WriteWaiter
+{
+public:
+  WriteWaiter() : _M_Waiting(false)
+  { }
+
+  virtual
+  ~WriteWaiter()
   { }
 
-  NMSTL_SIMPLY_SERIALIZABLE(fex_header, << type << wp_id << length);
+  virtual void
+  writable() = 0;
+
+private:
+  bool _M_Waiting;
+
+  friend class Connection;
 };
 
 
 class ConnectionPool;
 class ConnectedWatchPoint;
 class ClientWatchPoint;
+class NetThread;
 
 
 /*
@@ -165,25 +351,70 @@ public:
   typedef std::vector<char>              buffer_t;
   typedef nmstl::msg_handler<fex_header> parent;
 
-  parent::write_bytes_pending;
   parent::set_owned;
-  parent::set_socket;
-  parent::is_connected;
   parent::is_owned;
 
   Connection(nmstl::io_event_loop& loop, 
-	     nmstl::iohandle ioh);
+	     nmstl::iohandle ioh,
+	     bool tls = false);
   Connection(nmstl::io_event_loop& loop);
   virtual 
   ~Connection();
 
   bool 
   write(const fex_header& head) 
-  { return parent::write(head); }
+  { return write(head, nmstl::constbuf()); }
 
   bool
   write(const fex_header& head, nmstl::constbuf payload);
 
+  size_t
+  write_bytes_pending();
+
+  void
+  set_socket(nmstl::socket sock, bool established = false);
+
+  bool
+  is_connected();
+
+  std::string
+  peer_name();
+
+  // the number of watchpoints using this connection
+  size_t
+  watchpoint_count() const;
+
+  // true if a ConnectedWatchPoint of wp uses this connection
+  bool
+  carries(const WatchPoint* wp) const;
+
+  void
+  set_rate_limit(size_t rate)
+  { _M_Limit.set_rate(rate); }
+
+  // true if the peer replays missed changes (see ChangeJournal)
+  bool
+  resumable() const
+  { return _M_Resume; }
+
+  // the largest payload the peer accepts from rsync streams
+  size_t
+  max_frame() const
+  { return _M_MaxFrame; }
+
+  // like write_bytes_pending, but if true, waiter is subscribed
+  // for writable(). The waiters are woken in the order they blocked.
+  bool
+  write_blocked(WriteWaiter* waiter);
+
+  void
+  cancel_wait(WriteWaiter* waiter);
+
+  // false if the peer is known to read one byte ids only
+  bool
+  serves_wp_id(size_t wp_id) const
+  { return ! _M_Started || _M_WideIds || wp_id <= fex_header::long_wp_id; }
+
   ConnectionPool& 
   listener();
 
@@ -206,7 +437,30 @@ protected:
   virtual void 
   all_written();
 
+  virtual void
+  prepare_header(fex_header& head)
+  { 
+    head.wide_ids    = _M_WideIds;
+    head.long_frames = _M_LongFrames;
+  }
+
+  virtual bool
+  accept_header(const fex_header& head);
+
+  // the peer's ME_Start
+  virtual void
+  start(nmstl::constbuf buf);
+
+  static std::string
+  start_payload();
+
+  // the tls layer for a new socket, or NULL
+  nmstl::transport*
+  new_transport();
+
   WatchPoints_v _M_WatchPoints;
+  bool          _M_Tls;       // the socket is protected by TlsTransport
+  bool          _M_Accepted;  // the server side of the socket
 
 
 private:
@@ -222,9 +476,35 @@ private:
 
   typedef std::vector<lock> lock_v;
 
+  struct queued_message
+  {
+    fex_header  head;
+    std::string data;
+  };
+
+  typedef std::deque<queued_message>     message_q;
+  typedef std::map<size_t, message_q>    bulk_m;
+
+  class BulkTimer;
+
+  bool
+  send(const fex_header& head, nmstl::constbuf payload);
+
+  void
+  flushBulk();
+
   void
   calcSpeed(const fex_header &head);
 
+  void
+  probeAcknowledged(const LinkEstimator::probe& ack);
+
+  size_t
+  queued();
+
+  void
+  adjustCompression(int delta);
+
   void
   init();
 
@@ -234,14 +514,47 @@ private:
   void
   registerWatchPoint(size_t wp_id, nmstl::constbuf buf);
 
+  // called by NetThread in the MainLoop thread
+  void
+  channelWritten(size_t bytes, size_t throughput);
+
+  void
+  channelClosed(size_t remaining, int error);
+
   size_t              _M_DownloadSpeed;
   size_t              _M_UploadSpeed;
   nmstl::ntime        _M_TimerStart;
   size_t              _M_TimerSize;
   size_t              _M_TimerWatchPoint;
   int                 _M_CompressionLevel;
-  buffer_t            _M_CompressionBuffer;
+  MessageCompressor   _M_Compressor;
+  size_t              _M_CompressionThroughput;
+  LinkEstimator       _M_Link;
+  bool                _M_Probing;
+  size_t              _M_MaxFrame;
+  bool                _M_LongFrames; // the peer announced "frames"
+  bool                _M_Started;  // the peer's ME_Start arrived
+  bool                _M_WideIds;
+  bool                _M_Resume;
+  std::deque<WriteWaiter*> _M_Waiters;
+
+  // bulk messages waiting for the socket or the token buckets
+  bulk_m              _M_Bulk;
+  size_t              _M_BulkBytes;
+  TokenBucket         _M_Limit;
+  BulkTimer*          _M_BulkTimer;
   lock_v              _M_LockedFiles;
+
+  // set if the socket is served by a network thread
+  NetThread*          _M_NetThread;
+  unsigned long       _M_Channel;
+  std::string         _M_PeerName;
+  size_t              _M_Posted;
+  size_t              _M_Acked;
+  bool                _M_Blocked;
+
+  friend class NetThread;
+  friend class BulkTimer;
 };
 
 
@@ -260,19 +573,22 @@ public:
 
   int
   connect(bool ssh, 
+	  bool tls,
 	  const std::string& user, 
 	  const std::string& gateway, 
 	  const std::string& server,
 	  const std::string& port);
 
 
-  void
+  // false if the peer cannot serve another watchpoint on this stream
+  bool
   addWatchPoint(WatchPoint* wp, IDTranslator* translator, 
-		const std::string& import_name);
+		const std::string& import_name, const std::string& peer,
+		size_t rate_limit);
 
 private:
-  virtual void 
-  incoming_message(const fex_header &head, nmstl::constbuf buf);
+  virtual void
+  start(nmstl::constbuf buf);
 
   std::string
   start_ssh(const std::string& user, 
@@ -298,12 +614,16 @@ private:
 class ConnectionPool
 {
 public:
-  typedef std::map<std::string, ClientConnection*> ClientConnections_m;
+  typedef std::vector<ClientConnection*>               ClientConnection_v;
+  typedef std::map<std::string, ClientConnection_v>    ClientConnections_m;
+
+  enum { client_side = 1, server_side = 2, both_sides = 3 };
 
   static
   ConnectionPool&
   get();
 
+  // one of the (configuration streams) connections to key
   ClientConnection*
   get_client_connection(const std::string& key);
 
@@ -311,10 +631,17 @@ public:
   remove_client_connection(ClientConnection* con);
 
   void
-  add_connection();
+  add_connection(Connection* con);
+
+  void
+  remove_connection(Connection* con);
+
+  // closes the connections of the sides, which carry wp
+  void
+  drop_watch_point(const WatchPoint* wp, int sides);
 
   void
-  remove_connection();
+  set_rate_limit(size_t rate);
 
   void
   start_listening();
@@ -323,8 +650,8 @@ private:
   ConnectionPool();
   ~ConnectionPool();
   
-  int                 _M_ConnectionCount;
-  ClientConnections_m _M_Clients;
+  std::set<Connection*> _M_Connections;
+  ClientConnections_m   _M_Clients;
 };
 
 #endif
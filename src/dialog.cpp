@@ -128,6 +128,7 @@ incoming_message(const fex_header &head, constbuf buf)
     return;
 
   case ME_SyncComplete:
+    parent().syncAcknowledged();
     parent().sendLog()->clear();
     parent().save_state();
     endDialog();
@@ -271,6 +272,9 @@ doSync()
 
   ModLog::iterator i;
 
+  // access changes and new directories are applied in one batch
+  AccessBatch batch(*parent().wp());
+
   StackedDialog* dialog = new StackedDialog(parent());
   for(i = _M_Log.begin(); i != _M_Log.end(); i++) {
     if (! checkBackup(i->first, i->second))
@@ -302,6 +306,7 @@ doSync()
     switch(i->second.action) {
     case State::removed:
       lc.info("Sync remove file: %s", path.c_str());
+      batch.apply();
       parent().wp()->remove(i->first);
       break;
 
@@ -312,7 +317,7 @@ doSync()
 
     case State::newaccess:
       lc.info("Sync change access: %s", path.c_str());
-      parent().wp()->changeAccess(i->first, i->second);
+      batch.changeAccess(i->first, i->second);
       break;
 
     case State::created:
@@ -331,12 +336,12 @@ doSync()
 
     case State::mkdired:
       lc.info("Sync create dir: %s", path.c_str());
-      parent().wp()->remove(i->first);
-      parent().wp()->mkdir(i->first, i->second);
+      batch.mkdir(i->first, i->second);
       break;
 
     case State::rmdired:
       lc.info("Sync remove dir: %s", path.c_str());
+      batch.apply();
       parent().wp()->remove(i->first);
       break;
 
@@ -349,6 +354,8 @@ doSync()
     }
   }
 
+  batch.apply();
+
   if (dialog->empty()) {
     delete dialog;
     popUp();
@@ -453,7 +460,7 @@ start()
       _M_msg.str(string());
       _M_writer.reset();
 
-      if (parent().write_bytes_pending())
+      if (write_blocked())
 	return;
     }
   }
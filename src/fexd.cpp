@@ -30,6 +30,9 @@
 #include "configfile.h"
 #include "filelistener.h"
 #include "connection.h"
+#include "netthread.h"
+#include "metrics.h"
+#include "modlog.h"
 #include <getopt.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -82,6 +85,52 @@ terminate(int);
 static void 
 check_children(int);
 
+static void
+reload(int);
+
+
+/*
+  Reloads the configuration inside the MainLoop, after the signal
+  handler wrote to the pipe.
+*/
+class ReloadHandler : private io_handler
+{
+public:
+  ReloadHandler() : io_handler(MainLoop)
+  {
+    pair<iohandle, iohandle> ios = iohandle::pipe();
+    ios.first.set_blocking(false);
+    ios.second.set_blocking(false);
+
+    set_owned(true);
+    set_ioh(ios.first);
+    _M_Wake = ios.second;
+    _S_WakeFd = _M_Wake.get_fd();
+    want_read(true);
+  }
+
+  static void
+  wake()
+  { 
+    if (_S_WakeFd >= 0)
+      ::write(_S_WakeFd, "H", 1);
+  }
+
+private:
+  virtual void
+  ravail()
+  {
+    char garbage[16];
+    while(get_ioh().read(garbage, sizeof(garbage)) == sizeof(garbage));
+    Configuration::get().reload(config_file);
+  }
+
+  iohandle   _M_Wake;
+  static int _S_WakeFd;
+};
+
+int ReloadHandler::_S_WakeFd = -1;
+
 int
 main(int argc, char *argv[])
 {
@@ -104,8 +153,13 @@ main(int argc, char *argv[])
 
   lc.notice("%s started", version_string);
   Configuration::get().parse(config_file);
+  Metrics::get().listen(Configuration::get().metrics_socket());
+  NetThread::start(Configuration::get().threads());
+  StateLog::start_hashing(Configuration::get().hash_threads());
   ConnectionPool::get().start_listening();
 
+  ReloadHandler reloader;
+  signal(SIGHUP, reload);
   signal(SIGTERM, terminate);
   signal(SIGINT, terminate);
   signal(SIGPIPE, terminate);
@@ -126,6 +180,9 @@ main(int argc, char *argv[])
     lc.fatal("a really bad error occured");
   }
 
+  NetThread::stop();
+  StateLog::stop_hashing();
+  Metrics::get().listen("");
   MainLoop.tidy_handlers();
   lc.notice("fexd finished");
   lc.shutdown();
@@ -139,6 +196,12 @@ terminate(int)
   MainLoop.terminate();
 }
 
+void
+reload(int)
+{
+  ReloadHandler::wake();
+}
+
 void 
 check_children(int)
 {
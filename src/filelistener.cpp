@@ -30,7 +30,15 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 #include <cstdatomic>
+#include <algorithm>
+#include <set>
+
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
 
 
 using namespace std;
@@ -39,8 +47,15 @@ using namespace nmstl;
 
 extern io_event_loop MainLoop;
 
+enum {
+  // the seconds between two reads of /proc/locks with fanotify
+  rescan_interval = 60
+};
+
 /*
-  An active class for detecting changes in the file locks.
+  An active class for detecting changes in the file locks. With
+  fanotify only the processes, which opened files of the watchpoints,
+  are inspected. Otherwise /proc/locks is polled.
 */
 class FileListener::LockPoll : public timer
 {
@@ -48,35 +63,123 @@ public:
   LockPoll(FileListener& listener);
   ~LockPoll();
 
+  void
+  start();
+
+  void
+  stop();
+
+  void
+  mark(WatchPoint* wp);
+
   void
   resendFileLocks(WatchPoint* wp, ConnectedWatchPoint* arg);
 
+  void
+  forget(WatchPoint* wp);
+
 private:
   struct lock {
-    ino_t        inode;
-    dev_t        device;
+    dev_t         device;
+    ino_t         inode;
+    WatchPoint*   wp;
+    string        path;
+    char          type;
+    unsigned int  generation;
+    bool          used;
+
+    lock() : wp(NULL), used(false)
+    { }
+  };
+
+  /*
+    An open addressed hash set of the held locks, keyed by device and
+    inode. The entries following an erased one are shifted back, so no
+    tombstones are needed.
+  */
+  class LockSet
+  {
+  public:
+    LockSet();
+
+    lock&
+    insert(dev_t device, ino_t inode, bool& created);
+
+    void
+    erase(size_t slot);
+
+    size_t
+    size() const
+    { return _M_Count; }
+
+    size_t
+    capacity() const
+    { return _M_Table.size(); }
+
+    lock&
+    operator[](size_t slot)
+    { return _M_Table[slot]; }
+
+  private:
+    size_t
+    home(dev_t device, ino_t inode) const;
+
+    void
+    grow();
+
+    vector<lock> _M_Table;
+    size_t       _M_Count;
+  };
+
+  /*
+    A file of a watchpoint, which is held open by other processes.
+  */
+  struct open_file {
     WatchPoint*  wp;
     string       path;
-    char         type;
-    int          tag;
-
-    bool operator<(const lock& cmp) const
-    { return inode == cmp.inode ? device < cmp.device : inode < cmp.inode; }
+    set<pid_t>   pids;
   };
 
-  typedef vector<lock> locks_v;
+  typedef pair<dev_t, ino_t>       file_id;
+  typedef map<file_id, open_file>  open_files_m;
+
+  class OpenEvents;
 
   virtual void
   fire();
 
   void
-  test_locks(char* buffer, ssize_t size);
+  event(int fd, pid_t pid, bool opened);
+
+  void
+  overflowed();
+
+  ssize_t
+  read_proc_locks();
 
-  char*   _M_Buffer;
-  size_t  _M_BufferSize;
-  int     _M_LockFd;
-  locks_v _M_Locks;
-  off_t   _M_LastSize;
+  ssize_t
+  read_fd_locks();
+
+  void
+  append(ssize_t& size, const char* data, size_t length);
+
+  bool
+  resolve(lock& l, pid_t pid);
+
+  void
+  test_locks(const char* buffer, ssize_t size);
+
+  char*        _M_Buffer;
+  size_t       _M_BufferSize;
+  int          _M_LockFd;
+  LockSet      _M_Locks;
+  unsigned int _M_Generation;
+  OpenEvents*  _M_Events;   // NULL if /proc/locks is polled
+  bool         _M_Tried;    // fanotify was initialized
+  open_files_m _M_Open;
+  bool         _M_Rescan;   // read /proc/locks at the next check
+  ntime        _M_NextRescan;
+  bool         _M_Active;
 
   friend class FileListener;
 };
@@ -86,14 +189,6 @@ private:
 
 #ifdef USE_DNOTIFY
 
-#if HAVE_EXT_MALLOC_ALLOCATOR_H
-   #include <ext/malloc_allocator.h>
-   #define MALLOCATOR __gnu_cxx::malloc_allocator<int>
-#else
-   #define MALLOCATOR __malloc_alloc_template<0>
-#endif
-
-
 /*
   A Monitor using the dnotify mechanism to detect filesystem changes
 */
@@ -130,17 +225,30 @@ private:
   virtual void
   fire();
 
-  typedef MALLOCATOR                malloc_alloc;
-  typedef vector<int, malloc_alloc> fdbuffer_v;
-  typedef pair<iohandle,iohandle>   pipeends_t;
+  static
+  void
+  wake_up();
+
+  typedef pair<iohandle,iohandle> pipeends_t;
+
+  /*
+    The signal handler is the only producer and fire() the only
+    consumer of the ring, so it needs neither locks nor memory
+    allocation. If the ring overflows, all directories are renewed.
+    _S_Woken is set by the handler, which wakes up the loop, and
+    cleared by fire() before it takes the batch, so every entry (and
+    overflow) after the batch wakes up the loop again.
+  */
+  enum { RingSize = 4096 }; // must be a power of two
 
-  //static std::atomic<fdbuffer_v*> _S_SignalBuffer;
-  static std::atomic<void*> _S_SignalBuffer;
-  static sig_atomic_t _S_RenewAll;
-  static pipeends_t   _S_WakeUpPipe;
+  static volatile int              _S_Ring[RingSize];
+  static std::atomic<unsigned int> _S_RingHead;
+  static std::atomic<unsigned int> _S_RingTail;
+  static std::atomic<bool>         _S_Woken;
+  static volatile sig_atomic_t     _S_RenewAll;
+  static pipeends_t                _S_WakeUpPipe;
 
-  fdbuffer_v*   _M_ReadBuffer;
-  fdbuffer_v    _M_FDBuffer[2];
+  vector<int> _M_Fds;
 };
 
 #endif
@@ -191,78 +299,461 @@ private:
 
 /***************************************************************************/
 
+#ifdef HAVE_SYS_FANOTIFY_H
+
+/*
+  Reports the files opened and closed by other processes on the
+  mounts of the watchpoints.
+*/
+class FileListener::LockPoll::OpenEvents : public io_handler
+{
+public:
+  OpenEvents(LockPoll& poll, int fd) 
+    : io_handler(MainLoop, iohandle(fd), true), _M_Poll(poll)
+  {
+    want_read(true);
+  }
+
+  // reports the opened files of the mount of path too
+  bool
+  mark(const string& path)
+  {
+    return fanotify_mark(get_ioh().get_fd(), FAN_MARK_ADD | FAN_MARK_MOUNT, 
+			 FAN_OPEN | FAN_CLOSE, AT_FDCWD, path.c_str()) == 0;
+  }
+
+private:
+  virtual void
+  ravail()
+  {
+    char    buffer[4096];
+    ssize_t size;
+
+    while((size = get_ioh().read(buffer, sizeof(buffer))) > 0) {
+      struct fanotify_event_metadata* ev;
+      ev = (struct fanotify_event_metadata*)buffer;
+
+      for(; FAN_EVENT_OK(ev, size); ev = FAN_EVENT_NEXT(ev, size)) {
+	if (ev->mask & FAN_Q_OVERFLOW)
+	  _M_Poll.overflowed();
+
+	if (ev->fd < 0)
+	  continue;
+
+	if (ev->pid != getpid())
+	  _M_Poll.event(ev->fd, ev->pid, ev->mask & FAN_OPEN);
+
+	close(ev->fd);
+      }
+    }
+  }
+
+  LockPoll& _M_Poll;
+};
+
+#else
+
+class FileListener::LockPoll::OpenEvents
+{ };
+
+#endif
+
+
 FileListener::LockPoll::
 LockPoll(FileListener& listener) : timer(MainLoop)
 {
   _M_LockFd = open("/proc/locks", O_RDONLY);
-  _M_BufferSize = 1024;
+  _M_BufferSize = 16384;
   _M_Buffer = (char*)malloc(_M_BufferSize);
+  _M_Generation = 0;
+  _M_Events = NULL;
+  _M_Tried = false;
+  _M_Rescan = true;
+  _M_NextRescan = ntime::now();
+  _M_Active = false;
 }
 
 FileListener::LockPoll::
 ~LockPoll()
 {
+  delete _M_Events;
   close(_M_LockFd);
   free(_M_Buffer);
 }
 
+void FileListener::LockPoll::
+start()
+{
+  _M_Active = true;
+
+#ifdef HAVE_SYS_FANOTIFY_H
+  if (! _M_Tried) {
+    _M_Tried = true;
+
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+			   O_RDONLY | O_LARGEFILE);
+    if (fd >= 0) {
+      _M_Events = new OpenEvents(*this, fd);
+
+      typedef Configuration::WatchPoint_v WatchPoint_v;
+      const WatchPoint_v& wps = Configuration::get().watch_points();
+      WatchPoint_v::const_iterator i;
+      for(i = wps.begin(); _M_Events && i != wps.end(); i++)
+	mark(*i);
+    }
+    else
+      lc.notice("cannot use fanotify (%s), polling /proc/locks", 
+		strerror(errno));
+  }
+#endif
+
+  // the first check must see the locks, which are already held
+  _M_Rescan = true;
+  arm(ntime::now());
+}
+
+/*
+  Marks the mount of a watchpoint, also of one added by a reload. If
+  that fails, all watchpoints fall back to polling /proc/locks.
+*/
+void FileListener::LockPoll::
+mark(WatchPoint* wp)
+{
+#ifdef HAVE_SYS_FANOTIFY_H
+  if (! _M_Events || _M_Events->mark(wp->path()))
+    return;
+
+  lc.notice("cannot use fanotify for %s (%s), polling /proc/locks", 
+	    wp->path().c_str(), strerror(errno));
+  delete _M_Events;
+  _M_Events = NULL;
+  _M_Open.clear();
+  if (_M_Active)
+    arm(ntime::now());
+#endif
+}
+
+void FileListener::LockPoll::
+stop()
+{
+  _M_Active = false;
+  _M_Open.clear();
+  disarm();
+}
+
+void FileListener::LockPoll::
+event(int fd, pid_t pid, bool opened)
+{
+  if (! _M_Active)
+    return;
+
+  struct stat buf;
+  if (fstat(fd, &buf) || ! S_ISREG(buf.st_mode))
+    return;
+
+  file_id id(buf.st_dev, buf.st_ino);
+  open_files_m::iterator f = _M_Open.find(id);
+  
+  if (f == _M_Open.end()) {
+    if (! opened)
+      return;
+
+    char link[64];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%i", fd);
+    ssize_t length = readlink(link, path, sizeof(path));
+    if (length <= 0)
+      return;
+
+    open_file of;
+    of.path.assign(path, length);
+    of.wp = NULL;
+
+    typedef Configuration::WatchPoint_v WatchPoint_v;
+    const WatchPoint_v& wps = Configuration::get().watch_points();
+    WatchPoint_v::const_iterator i;
+    for(i = wps.begin(); i != wps.end() && ! of.wp; i++) {
+      const string& root = (*i)->path();
+      if (of.path.compare(0, root.length(), root) == 0 
+	  && (*i)->isValidPath(of.path))
+	of.wp = *i;
+    }
+
+    if (! of.wp)
+      // not a file of a watchpoint
+      return;
+
+    f = _M_Open.insert(open_files_m::value_type(id, of)).first;
+  }
+
+  // closed files are removed by the next check
+  if (opened)
+    f->second.pids.insert(pid);
+
+  // the timer may wait for the next rescan
+  ntime soon = ntime::now_plus_msecs(50);
+  if (! is_armed() || get_when().to_usecs() > soon.to_usecs())
+    arm(soon);
+}
+
+void FileListener::LockPoll::
+overflowed()
+{
+  lc.warn("fanotify queue overflowed, rereading /proc/locks");
+  _M_Rescan = true;
+  if (_M_Active)
+    arm(ntime::now());
+}
+
 void FileListener::LockPoll::
 fire()
 {
-  const int MIN_LINE_SIZE = 26; // minimal size of a lock line
-  static int count = 0;
-  ssize_t size;
+  // fanotify misses the files opened before the marks were set (or
+  // lost by an overflow) and locked later, /proc/locks is reread
+  // from time to time to find them anyway
+  ntime now = ntime::now();
+  if (_M_NextRescan.to_usecs() <= now.to_usecs())
+    _M_Rescan = true;
+
+  if (_M_Events && ! _M_Rescan) {
+    // locks are aquired after opening a file, so the files are
+    // inspected until they are closed
+    test_locks(_M_Buffer, read_fd_locks());
+    if (! _M_Open.empty())
+      arm(now + ntime::secs(1));
+    else
+      arm(_M_NextRescan);
+    return;
+  }
+
+  test_locks(_M_Buffer, read_proc_locks());
+  _M_Rescan = false;
+  _M_NextRescan = now + ntime::secs(rescan_interval);
+
+  if (! _M_Events || ! _M_Open.empty())
+    arm(now + ntime::secs(1));
+  else
+    arm(_M_NextRescan);
+}
 
-  lseek(_M_LockFd, 0, SEEK_SET);
-  while((size = read(_M_LockFd, _M_Buffer, _M_BufferSize)) >= _M_BufferSize) {
-    _M_BufferSize += 1024;
+ssize_t FileListener::LockPoll::
+read_proc_locks()
+{
+  // one read gives a consistent snapshot of all locks
+  ssize_t size;
+  while((size = pread(_M_LockFd, _M_Buffer, _M_BufferSize - 1, 0)) 
+	== (ssize_t)_M_BufferSize - 1) {
+    _M_BufferSize *= 2;
     _M_Buffer = (char*)realloc(_M_Buffer, _M_BufferSize);
-    lseek(_M_LockFd, 0, SEEK_SET);
   }
 
-  /* count++ % 10:
-     if a lock was released and another was aquired within one second
-     fex will not register it. Therefore check all locks all 10 seconds.
-  */
-  if (abs(_M_LastSize - size) > MIN_LINE_SIZE || count++ % 10 == 0) {
-    test_locks(_M_Buffer, size);
-    _M_LastSize = size;
+  size = max(size, (ssize_t)0);
+  _M_Buffer[size] = 0;
+  return size;
+}
+
+/*
+  Collects the lock lines of the descriptors, the tracked processes
+  hold on the open files, from /proc/<pid>/fdinfo. Processes which
+  closed a file are removed from it.
+*/
+ssize_t FileListener::LockPoll::
+read_fd_locks()
+{
+  typedef map<pid_t, set<file_id> > pids_m;
+  pids_m pids;
+  ssize_t size = 0;
+
+  open_files_m::iterator i;
+  set<pid_t>::iterator p;
+  for(i = _M_Open.begin(); i != _M_Open.end(); i++) {
+    for(p = i->second.pids.begin(); p != i->second.pids.end(); p++)
+      pids[*p];
   }
 
-  arm(ntime::now_plus_secs(1));
+  pids_m::iterator j;
+  for(j = pids.begin(); j != pids.end(); j++) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/proc/%i/fd", (int)j->first);
+
+    DIR* d = opendir(dir);
+    if (! d)
+      continue;
+
+    struct dirent* entry;
+    while((entry = readdir(d))) {
+      if (entry->d_name[0] == '.')
+	continue;
+
+      char file[PATH_MAX];
+      struct stat buf;
+      snprintf(file, sizeof(file), "/proc/%i/fd/%s", 
+	       (int)j->first, entry->d_name);
+      if (stat(file, &buf))
+	continue;
+
+      file_id id(buf.st_dev, buf.st_ino);
+      if (! _M_Open.count(id))
+	continue;
+
+      j->second.insert(id);
+
+      snprintf(file, sizeof(file), "/proc/%i/fdinfo/%s", 
+	       (int)j->first, entry->d_name);
+      ifstream info(file);
+      string line;
+      while(getline(info, line)) {
+	if (line.compare(0, 5, "lock:") == 0) {
+	  size_t start = line.find_first_not_of(" \t", 5);
+	  if (start == string::npos)
+	    continue;
+	  line += '\n';
+	  append(size, line.data() + start, line.length() - start);
+	}
+      }
+    }
+
+    closedir(d);
+  }
+
+  _M_Buffer[size] = 0;
+
+  // forget the processes, which closed the files
+  for(i = _M_Open.begin(); i != _M_Open.end();) {
+    for(p = i->second.pids.begin(); p != i->second.pids.end();) {
+      if (! pids[*p].count(i->first))
+	i->second.pids.erase(p++);
+      else
+	p++;
+    }
+
+    if (i->second.pids.empty())
+      _M_Open.erase(i++);
+    else
+      i++;
+  }
+
+  return size;
 }
 
-inline int
-inttok(char *str, const char *delim) 
+void FileListener::LockPoll::
+append(ssize_t& size, const char* data, size_t length)
 {
-  char* tmp = strtok(str, delim);
-  return tmp ? atoi(tmp) : 0;
+  if (size + length >= _M_BufferSize) {
+    _M_BufferSize = size + length + 1024;
+    _M_Buffer = (char*)realloc(_M_Buffer, _M_BufferSize);
+  }
+
+  memcpy(_M_Buffer + size, data, length);
+  size += length;
 }
 
-void FileListener::LockPoll::
-test_locks(char* buffer, ssize_t size)
+/*
+  Finds the watchpoint and the path of a new lock.
+*/
+bool FileListener::LockPoll::
+resolve(lock& l, pid_t pid)
 {
-  static int tag = 0;
-  tag++;
+  open_files_m::iterator f = _M_Open.find(file_id(l.device, l.inode));
+  if (f != _M_Open.end()) {
+    l.wp   = f->second.wp;
+    l.path = f->second.path;
+    return true;
+  }
 
-  buffer[size] = 0;
-  char *lastread = buffer;
-  char *line = strtok(lastread, "\n");
+  typedef Configuration::WatchPoint_v WatchPoint_v;
+  const WatchPoint_v& wps = Configuration::get().watch_points();
+  WatchPoint_v::const_iterator i;
+  for(i = wps.begin(); i != wps.end(); i++) {
+    if ((*i)->find_path(l.inode, l.device, l.path)) {
+      l.wp = *i;
+
+      if (_M_Events) {
+	// watch the holder of the lock, until it closes the file
+	open_file& of = _M_Open[file_id(l.device, l.inode)];
+	of.wp   = l.wp;
+	of.path = l.path;
+	of.pids.insert(pid);
+      }
+      return true;
+    }
+  }
 
-  while(line && line < buffer + size) {
-    lastread = line + strlen(line) + 1;
-    char* no    = strtok(line, " ");
-    char* clas  = strtok(NULL, " ");
-    char* mode  = strtok(NULL, " ");
-    char* type  = strtok(NULL, " ");
-    pid_t pid   = inttok(NULL, " ");
-    int   major = inttok(NULL, ":");
-    int   minor = inttok(NULL, ":");
-    ino_t inode = inttok(NULL, " ");
+  return false;
+}
 
-    line = strtok(lastread, "\n");
+/*
+  Returns the start of the field following p.
+*/
+static inline const char*
+next_field(const char* p, const char* end)
+{
+  while(p < end && *p != ' ' && *p != '\t')
+    p++;
+  while(p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+/*
+  Parses a line of /proc/locks in place, e.g.
+  "1: POSIX  ADVISORY  WRITE 1234 08:01:5678 0 EOF".
+  Blocked requests ("1: -> POSIX ...") are no locks.
+*/
+static bool
+scan_lock(const char* p, const char* end, 
+	  char& type, pid_t& pid, dev_t& device, ino_t& inode)
+{
+  p = next_field(p, end);    // skip the number
+  if (p >= end || *p == '-')
+    return false;
+
+  p = next_field(p, end);    // skip the class
+  p = next_field(p, end);    // skip the mode
+  if (p >= end)
+    return false;
+
+  type = tolower(*p);
+  p = next_field(p, end);
+
+  char* q;
+  pid = strtol(p, &q, 10);
+  if (q == p || q >= end || *q != ' ')
+    return false;
+
+  unsigned long major = strtoul(q + 1, &q, 16);
+  if (q >= end || *q != ':')
+    return false;
+
+  unsigned long minor = strtoul(q + 1, &q, 16);
+  if (q >= end || *q != ':')
+    return false;
+
+  inode  = strtoull(q + 1, &q, 10);
+  device = makedev(major, minor);
+  return pid != 0;
+}
 
-    if (! type || ! pid) 
+void FileListener::LockPoll::
+test_locks(const char* buffer, ssize_t size)
+{
+  unsigned int generation = ++_M_Generation;
+  size_t       seen = 0;
+  const char*  end = buffer + size;
+  const char*  line;
+  const char*  eol;
+
+  for(line = buffer; line < end; line = eol + 1) {
+    eol = (const char*)memchr(line, '\n', end - line);
+    if (! eol)
+      eol = end;
+
+    char  type;
+    pid_t pid;
+    dev_t device;
+    ino_t inode;
+
+    if (! scan_lock(line, eol, type, pid, device, inode))
       // a wrong line
       continue;
 
@@ -270,49 +761,47 @@ test_locks(char* buffer, ssize_t size)
       // skip my own locks
       continue;
     
-    lock l;
+    bool  created;
+    lock& l = _M_Locks.insert(device, inode, created);
 
-    l.inode  = inode;
-    l.device = (major << 8) | minor;
-    l.type   = tolower(type[0]);
-    
-    locks_v::iterator f = lower_bound(_M_Locks.begin(), 
-				      _M_Locks.end(),
-				      l);
-
-    if (f != _M_Locks.end() && 
-	f->inode == l.inode && 
-	f->device == l.device) {
-      f->tag = tag;
-      continue;
-    }
+    if (l.generation != generation || created)
+      seen++;
 
-    typedef Configuration::WatchPoint_v WatchPoint_v;
-    const WatchPoint_v& wps = Configuration::get().watch_points();
-    WatchPoint_v::const_iterator i;
-    for(i = wps.begin(); i != wps.end(); i++) {
-      if ((*i)->find_path(l.inode, l.device, l.path)) {
+    l.generation = generation;
+    if (created) {
+      l.type = type;
+      if (resolve(l, pid)) {
 	//insert new locks
-	(*i)->notifyFileLock(l.path, l.type);
-	l.wp = *i;
+	l.wp->notifyFileLock(l.path, l.type);
 	lc.info("found new lock: %s", l.path.c_str());
-	break;
       }
     }
-    
-    l.tag = tag;
-    _M_Locks.insert(f, l);
+
+    if (_M_Events && pid > 0 && ! l.path.empty()) {
+      // a lock found by a rescan is checked by its descriptors
+      // afterwards, like the files reported by fanotify
+      open_file& of = _M_Open[file_id(device, inode)];
+      of.wp   = l.wp;
+      of.path = l.path;
+      of.pids.insert(pid);
+    }
   }
 
+  if (seen == _M_Locks.size())
+    // no lock was released
+    return;
+
   // notify and delete removed locks
-  locks_v::iterator i;
-  for(i = _M_Locks.begin(); i != _M_Locks.end();) {
-    if (i->tag != tag) {
-      if (! i->path.empty()) {
-	i->wp->notifyFileLock(i->path, 'u');
-	lc.info("lock was released: %s", i->path.c_str());
+  for(size_t i = 0; i < _M_Locks.capacity();) {
+    lock& l = _M_Locks[i];
+    if (l.used && l.generation != generation) {
+      if (! l.path.empty()) {
+	l.wp->notifyFileLock(l.path, 'u');
+	lc.info("lock was released: %s", l.path.c_str());
       }
-      i =_M_Locks.erase(i);
+
+      // erase shifts the next entry into this slot
+      _M_Locks.erase(i);
       continue;
     }
     i++;
@@ -320,25 +809,133 @@ test_locks(char* buffer, ssize_t size)
 }
 
 
+FileListener::LockPoll::LockSet::
+LockSet() : _M_Table(64), _M_Count(0)
+{
+}
+
+size_t FileListener::LockPoll::LockSet::
+home(dev_t device, ino_t inode) const
+{
+  unsigned long long h = inode * 0x9e3779b97f4a7c15ULL ^ device;
+  h ^= h >> 29;
+  return h & (_M_Table.size() - 1);
+}
+
+FileListener::LockPoll::lock& 
+FileListener::LockPoll::LockSet::
+insert(dev_t device, ino_t inode, bool& created)
+{
+  if ((_M_Count + 1) * 2 > _M_Table.size())
+    grow();
+
+  size_t mask = _M_Table.size() - 1;
+  size_t i;
+  for(i = home(device, inode); _M_Table[i].used; i = (i + 1) & mask) {
+    if (_M_Table[i].device == device && _M_Table[i].inode == inode) {
+      created = false;
+      return _M_Table[i];
+    }
+  }
+
+  lock& l = _M_Table[i];
+  l.device = device;
+  l.inode  = inode;
+  l.wp     = NULL;
+  l.used   = true;
+  _M_Count++;
+  created = true;
+  return l;
+}
+
+void FileListener::LockPoll::LockSet::
+erase(size_t hole)
+{
+  size_t mask = _M_Table.size() - 1;
+  size_t i = hole;
+
+  for(;;) {
+    i = (i + 1) & mask;
+    if (! _M_Table[i].used)
+      break;
+
+    // an entry may only move towards its home slot
+    size_t h = home(_M_Table[i].device, _M_Table[i].inode);
+    if (((i - h) & mask) >= ((i - hole) & mask)) {
+      swap(_M_Table[hole], _M_Table[i]);
+      hole = i;
+    }
+  }
+
+  _M_Table[hole].used = false;
+  _M_Table[hole].path.clear();
+  _M_Count--;
+}
+
+void FileListener::LockPoll::LockSet::
+grow()
+{
+  vector<lock> old(_M_Table.size() * 2);
+  old.swap(_M_Table);
+  _M_Count = 0;
+
+  vector<lock>::iterator i;
+  for(i = old.begin(); i != old.end(); i++) {
+    if (! i->used)
+      continue;
+
+    bool  created;
+    lock& l = insert(i->device, i->inode, created);
+    l.wp         = i->wp;
+    l.type       = i->type;
+    l.generation = i->generation;
+    l.path.swap(i->path);
+  }
+}
+
+
 void FileListener::LockPoll::
 resendFileLocks(WatchPoint* wp, ConnectedWatchPoint* arg)
 {
-  locks_v::iterator i;
-  for(i = _M_Locks.begin(); i != _M_Locks.end(); i++) {
-    if (! i->path.empty() && i->wp == wp)
-      i->wp->notifyFileLock(i->path, i->type, arg);
+  for(size_t i = 0; i < _M_Locks.capacity(); i++) {
+    lock& l = _M_Locks[i];
+    if (l.used && ! l.path.empty() && l.wp == wp)
+      l.wp->notifyFileLock(l.path, l.type, arg);
   }
 }
 
 
 
+void FileListener::LockPoll::
+forget(WatchPoint* wp)
+{
+  // the locks stay in the set, to not report them again
+  for(size_t i = 0; i < _M_Locks.capacity(); i++) {
+    lock& l = _M_Locks[i];
+    if (l.used && l.wp == wp) {
+      l.wp = NULL;
+      l.path.clear();
+    }
+  }
+
+  open_files_m::iterator i;
+  for(i = _M_Open.begin(); i != _M_Open.end();) {
+    if (i->second.wp == wp)
+      _M_Open.erase(i++);
+    else
+      i++;
+  }
+}
+
+
 /***************************************************************************/
 
 #ifdef USE_DNOTIFY
-const int MinFDBufferSize = 100;
-//std::atomic<DNotifyMonitor::fdbuffer_v*> DNotifyMonitor::_S_SignalBuffer(NULL);
-std::atomic<void*> DNotifyMonitor::_S_SignalBuffer(NULL);
-sig_atomic_t DNotifyMonitor::_S_RenewAll = false;
+volatile int DNotifyMonitor::_S_Ring[RingSize];
+std::atomic<unsigned int> DNotifyMonitor::_S_RingHead(0);
+std::atomic<unsigned int> DNotifyMonitor::_S_RingTail(0);
+std::atomic<bool> DNotifyMonitor::_S_Woken(false);
+volatile sig_atomic_t DNotifyMonitor::_S_RenewAll = false;
 DNotifyMonitor::pipeends_t DNotifyMonitor::_S_WakeUpPipe;
 
 DNotifyMonitor::
@@ -356,15 +953,13 @@ setup_handler()
 {
   lc.notice("use dnotify for monitoring files");
 
-  _M_FDBuffer[0].reserve(MinFDBufferSize);
-  _M_FDBuffer[1].reserve(MinFDBufferSize);
-  _S_SignalBuffer.store(&_M_FDBuffer[0]);
-  _M_ReadBuffer   = &_M_FDBuffer[1];
+  _M_Fds.reserve(RingSize);
 
   assert(! _S_WakeUpPipe.first);
   assert(! _S_WakeUpPipe.second);
   _S_WakeUpPipe = iohandle::pipe();
   _S_WakeUpPipe.first.set_blocking(false);
+  _S_WakeUpPipe.second.set_blocking(false);
   _M_Handler->set_ioh(_S_WakeUpPipe.first);
   _M_Handler->want_read(true);
   _M_Handler->want_write(false);
@@ -397,12 +992,6 @@ shutdown_handler()
 int DNotifyMonitor::
 start_monitor(const string& dir)
 {
-  fdbuffer_v* sb = (fdbuffer_v*)&_S_SignalBuffer;
-  if (sb->capacity() <= _M_Handler->size()) {
-    // to increase the _S_SignalBuffer
-    fire();
-  }
-
   int fd = open(dir.c_str(), O_RDONLY);
 
   if (fd > 0) {
@@ -441,20 +1030,32 @@ fire()
 {
   typedef FileListener::FileEvent::reqs_m::iterator iterator;
 
-  _M_ReadBuffer->reserve(_M_Handler->size() + MinFDBufferSize);
-  _S_SignalBuffer.store(_M_ReadBuffer);
-  _M_ReadBuffer   = &_M_FDBuffer[_M_ReadBuffer == &_M_FDBuffer[0] ? 1 : 0];
+  // take the whole batch out of the ring
+  _S_Woken.store(false);
+  unsigned int tail = _S_RingTail.load();
+  unsigned int head = _S_RingHead.load();
+
+  _M_Fds.clear();
+  for(; tail != head; tail++)
+    _M_Fds.push_back((int)_S_Ring[tail & (RingSize - 1)]);
+
+  _S_RingTail.store(tail);
 
   if (_S_RenewAll) {
+    // reset before renewing, an overflow meanwhile needs another run
+    _S_RenewAll = false;
+
     iterator i = _M_Handler->reqs().begin();
     for(;i != _M_Handler->reqs().end(); i++) {
       i->second.wp->changeDB(*i->second.path);
     }
-    _S_RenewAll = false;
   }
   else {
-    fdbuffer_v::iterator i;
-    for(i = _M_ReadBuffer->begin(); i != _M_ReadBuffer->end(); i++) {
+    sort(_M_Fds.begin(), _M_Fds.end());
+    vector<int>::iterator end = unique(_M_Fds.begin(), _M_Fds.end());
+
+    vector<int>::iterator i;
+    for(i = _M_Fds.begin(); i != end; i++) {
       iterator item = _M_Handler->reqs().find(*i);
       
       if (item == _M_Handler->reqs().end())
@@ -463,8 +1064,14 @@ fire()
       item->second.wp->changeDB(*item->second.path);
     }
   }
+}
 
-  _M_ReadBuffer->clear();
+
+void DNotifyMonitor::
+wake_up()
+{
+  char c(0);
+  write(_S_WakeUpPipe.second.get_fd(), &c, sizeof(c));
 }
 
 
@@ -475,26 +1082,32 @@ io_signal(int sig, siginfo_t *si, void *data)
   // A signal says, that we got an overflow.
   // ==> check all watchpoints
   _S_RenewAll = true;
+  wake_up();
 }
 
 void DNotifyMonitor::
 dnotify_handler(int sig, siginfo_t *si, void *data)
 {
-  //fdbuffer_v* buffer  = (fdbuffer_v*)&_S_SignalBuffer;
-  fdbuffer_v* buffer  = (fdbuffer_v*)_S_SignalBuffer.load();
-  bool        wake_up = buffer->empty();
-
-  fdbuffer_v::iterator i = lower_bound(buffer->begin(), 
-				       buffer->end(),
-				       si->si_fd);
+  int          saved_errno = errno;
+  unsigned int head = _S_RingHead.load();
+  unsigned int tail = _S_RingTail.load();
 
-  if (i == buffer->end() || *i != si->si_fd)
-    buffer->insert(i, si->si_fd);
-  
-  if (wake_up) {
-    char c(0);
-    write(_S_WakeUpPipe.second.get_fd(), &c, sizeof(c));
+  if (head != tail && _S_Ring[(head - 1) & (RingSize - 1)] == si->si_fd) {
+    // the directory is already queued
+  }
+  else if (head - tail >= (unsigned int)RingSize) {
+    _S_RenewAll = true;
   }
+  else {
+    _S_Ring[head & (RingSize - 1)] = si->si_fd;
+    _S_RingHead.store(head + 1);
+  }
+
+  // the first event after fire() took its batch wakes up the loop
+  if (! _S_Woken.exchange(true))
+    wake_up();
+
+  errno = saved_errno;
 }
 
 #endif
@@ -640,6 +1253,23 @@ remove(const Path& path)
 }
  
 
+void FileListener::FileEvent::
+remove(WatchPoint* wp)
+{
+  reqs_m::iterator i;
+  for(i = _M_Reqs.begin(); i != _M_Reqs.end();) {
+    if (i->second.wp != wp) {
+      i++;
+      continue;
+    }
+
+    string path(*i->second.path);
+    _S_Monitor->stop_monitor(path, i->first);
+    _M_Dirs.erase(path);
+    _M_Reqs.erase(i++);
+  }
+}
+
 void 
 FileListener::FileEvent::
 ravail()
@@ -732,6 +1362,21 @@ resendFileLocks(WatchPoint* wp, ConnectedWatchPoint* arg)
     _M_LockPoll->resendFileLocks(wp, arg);
 }
 
+void FileListener::
+addWatchPoint(WatchPoint* wp)
+{
+  if (do_lock_polling)
+    _M_LockPoll->mark(wp);
+}
+
+void FileListener::
+removeWatchPoint(WatchPoint* wp)
+{
+  _M_FileEvent->remove(wp);
+  if (do_lock_polling)
+    _M_LockPoll->forget(wp);
+}
+
 void* FileListener::
 notifyChange(WatchPoint* wp, const Path& path, const State& state)
 {
@@ -774,17 +1419,15 @@ unlock(WatchPoint* wp, const string& path, const State& state)
 void FileListener::
 startLockPoll()
 {
-  if (do_lock_polling) {
-    _M_LockPoll->_M_LastSize = 0;
-    _M_LockPoll->arm(ntime::now());
-  }
+  if (do_lock_polling)
+    _M_LockPoll->start();
 }
 
 void FileListener::
 stopLockPoll()
 {
   if (do_lock_polling)
-    _M_LockPoll->disarm();
+    _M_LockPoll->stop();
 }
 
 FileListener& 
@@ -60,6 +60,14 @@ public:
   void
   resendFileLocks(WatchPoint* wp, ConnectedWatchPoint* arg);
 
+  // watches the locks of a watchpoint added by a reload
+  void
+  addWatchPoint(WatchPoint* wp);
+
+  // forgets the directories and locks of a deleted watchpoint
+  void
+  removeWatchPoint(WatchPoint* wp);
+
   static 
   FileListener& 
   get();
@@ -145,6 +153,9 @@ public:
   void
   remove(const Path& path);
 
+  void
+  remove(WatchPoint* wp);
+
   void
   clear();
 
@@ -0,0 +1,118 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "logging.h"
+#include "journal.h"
+#include "watchpoint.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+ChangeJournal::
+ChangeJournal()
+  : _M_Next(1)
+{
+}
+
+const string&
+ChangeJournal::
+epoch()
+{
+  static string epoch;
+  if (epoch.empty()) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%lx.%lx", 
+	     (unsigned long)time(NULL), (unsigned long)getpid());
+    epoch = buffer;
+  }
+
+  return epoch;
+}
+
+void ChangeJournal::
+record(const string& key, const State& state, const string& origin)
+{
+  _M_Entries.push_back(Entry());
+  Entry& entry = _M_Entries.back();
+  entry.seq    = _M_Next++;
+  entry.key    = key;
+  entry.state  = state;
+  entry.origin = origin;
+
+  if (_M_Entries.size() > max_entries)
+    _M_Entries.pop_front();
+}
+
+string ChangeJournal::
+peer_epoch(const string& peer) const
+{
+  Session_m::const_iterator f = _M_Sessions.find(peer);
+  return f != _M_Sessions.end() ? f->second.epoch : string();
+}
+
+bool ChangeJournal::
+resumable(const string& peer, const string& epoch) const
+{
+  Session_m::const_iterator f = _M_Sessions.find(peer);
+  if (f == _M_Sessions.end() || f->second.epoch != epoch)
+    return false;
+
+  // the oldest change missed by the peer must still be journaled
+  return _M_Entries.empty() || _M_Entries.front().seq <= f->second.acked + 1;
+}
+
+void ChangeJournal::
+replay(const string& peer, ConnectedWatchPoint& sink) const
+{
+  Session_m::const_iterator f = _M_Sessions.find(peer);
+  seq_t acked = f != _M_Sessions.end() ? f->second.acked : 0;
+  size_t count = 0;
+
+  Entry_q::const_iterator i;
+  for(i = _M_Entries.begin(); i != _M_Entries.end(); i++) {
+    // the peer knows its own changes
+    if (i->seq > acked && i->origin != peer) {
+      sink.addToLog(i->key, i->state, NULL, false);
+      count++;
+    }
+  }
+
+  lc.info("replay %lu changes for %s", (unsigned long)count, peer.c_str());
+}
+
+void ChangeJournal::
+begin(const string& peer, const string& epoch, seq_t seq)
+{
+  Session& session = _M_Sessions[peer];
+  session.epoch = epoch;
+  session.acked = seq;
+}
+
+void ChangeJournal::
+acknowledge(const string& peer, seq_t seq)
+{
+  Session_m::iterator f = _M_Sessions.find(peer);
+  if (f != _M_Sessions.end() && f->second.acked < seq)
+    f->second.acked = seq;
+}
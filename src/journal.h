@@ -0,0 +1,112 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "modlog.h"
+#include <deque>
+#include <map>
+#include <string>
+
+class ConnectedWatchPoint;
+
+
+/*
+  The recent changes of a watchpoint, numbered by a sequence, and the
+  sessions of its peers. A session remembers the epoch (the fexd
+  process) of a peer and the last change the peer acknowledged. If the
+  peer reconnects within the same epochs and the journal still holds
+  all changes after the acknowledged one, only these are replayed
+  instead of a full synchronisation.
+*/
+class ChangeJournal
+{
+public:
+  typedef unsigned long long seq_t;
+
+  enum { max_entries = 16384 };
+
+  ChangeJournal();
+
+  // the identity of this fexd process
+  static const std::string&
+  epoch();
+
+  // origin is the peer, which caused the change (or empty)
+  void
+  record(const std::string& key, const State& state, 
+	 const std::string& origin);
+
+  // the sequence of the last change
+  seq_t
+  last() const
+  { return _M_Next - 1; }
+
+  // the epoch of the last session with peer (or empty)
+  std::string
+  peer_epoch(const std::string& peer) const;
+
+  // true if peer in epoch misses only changes, which are journaled
+  bool
+  resumable(const std::string& peer, const std::string& epoch) const;
+
+  // adds the changes peer misses to the log of sink
+  void
+  replay(const std::string& peer, ConnectedWatchPoint& sink) const;
+
+  // a session with peer, which has all changes up to seq
+  void
+  begin(const std::string& peer, const std::string& epoch, seq_t seq);
+
+  void
+  acknowledge(const std::string& peer, seq_t seq);
+
+private:
+  struct Entry
+  {
+    seq_t       seq;
+    std::string key;
+    State       state;
+    std::string origin;
+  };
+
+  struct Session
+  {
+    std::string epoch;
+    seq_t       acked;
+  };
+
+  typedef std::deque<Entry>                 Entry_q;
+  typedef std::map<std::string, Session>    Session_m;
+
+  Entry_q   _M_Entries;
+  Session_m _M_Sessions;
+  seq_t     _M_Next;
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
@@ -0,0 +1,481 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "logging.h"
+#include "metrics.h"
+#include "configfile.h"
+#include "watchpoint.h"
+#include "connection.h"
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace nmstl;
+
+extern io_event_loop MainLoop;
+
+
+/*
+  One reader of the metrics. Its request (an HTTP GET or nothing at
+  all) is read and ignored, then the metrics are written and the
+  socket is closed. HTTP clients get a response header.
+*/
+class MetricsScrape : private io_handler
+{
+public:
+  MetricsScrape(int fd)
+    : io_handler(MainLoop), _M_Written(0), _M_Started(false)
+  {
+    iohandle ioh(fd);
+    ioh.set_blocking(false);
+
+    set_owned(false);
+    set_ioh(ioh);
+    want_read(true);
+  }
+
+private:
+  // reads all available input, returns false at the end of input
+  bool
+  drain(string* head)
+  {
+    char    buffer[4096];
+    ssize_t size;
+
+    while((size = ::read(get_ioh().get_fd(), buffer, sizeof(buffer))) > 0) {
+      if (head && head->length() < 4)
+	head->append(buffer, min((size_t)size, 4 - head->length()));
+    }
+
+    return size < 0 && (errno == EAGAIN || errno == EINTR);
+  }
+
+  virtual void
+  ravail()
+  {
+    string head;
+    bool   open = drain(&head);
+
+    if (! open)
+      want_read(false);
+
+    if (! _M_Started) {
+      _M_Started = true;
+      if (head == "GET " || head == "HEAD")
+	_M_Reply = "HTTP/1.0 200 OK\r\n"
+	  "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+      if (head != "HEAD")
+	_M_Reply += Metrics::get().render();
+
+      want_write(true);
+    }
+  }
+
+  virtual void
+  wavail()
+  {
+    while(_M_Written < _M_Reply.length()) {
+      // a reader gone must not raise SIGPIPE (see fexd.cpp)
+      ssize_t size = ::send(get_ioh().get_fd(), 
+			    _M_Reply.data() + _M_Written,
+			    _M_Reply.length() - _M_Written, MSG_NOSIGNAL);
+      if (size < 0) {
+	if (errno == EAGAIN)
+	  return;
+
+	if (errno != EINTR)
+	  break;
+      }
+      else
+	_M_Written += size;
+    }
+
+    // unread input would reset the connection of the reader
+    drain(NULL);
+    delete this;
+  }
+
+  string _M_Reply;
+  size_t _M_Written;
+  bool   _M_Started;
+};
+
+
+/*
+  The listening unix socket of the metrics.
+*/
+class MetricsEndpoint : private io_handler
+{
+public:
+  MetricsEndpoint(int fd, const string& path)
+    : io_handler(MainLoop), _M_Path(path)
+  {
+    iohandle ioh(fd);
+    ioh.set_blocking(false);
+
+    set_owned(true);
+    set_ioh(ioh);
+    want_read(true);
+  }
+
+  ~MetricsEndpoint()
+  {
+    ::unlink(_M_Path.c_str());
+  }
+
+private:
+  virtual void
+  ravail()
+  {
+    int fd;
+    while((fd = ::accept(get_ioh().get_fd(), NULL, NULL)) >= 0) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      new MetricsScrape(fd);
+    }
+  }
+
+  string _M_Path;
+};
+
+
+/***************************************************************************/
+
+// seconds
+const double Metrics::Histogram::bounds[Metrics::Histogram::buckets] = {
+  0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300, 900, 3600
+};
+
+Metrics::Histogram::
+Histogram()
+{
+  memset(count, 0, sizeof(count));
+  sum = 0;
+}
+
+void Metrics::Histogram::
+observe(double value)
+{
+  int i = 0;
+  while(i < buckets && value > bounds[i])
+    i++;
+
+  count[i]++;
+  sum += value;
+}
+
+
+Metrics::
+Metrics()
+  : _M_CompressIn(0), _M_CompressOut(0)
+{
+  memset(_M_Messages, 0, sizeof(_M_Messages));
+  memset(_M_Bytes, 0, sizeof(_M_Bytes));
+  _M_Literal     = 0;
+  _M_Matched     = 0;
+  _M_Hashed      = 0;
+  _M_HashSeconds = 0;
+  _M_Endpoint    = NULL;
+}
+
+Metrics::
+~Metrics()
+{
+  delete _M_Endpoint;
+}
+
+Metrics& Metrics::
+get()
+{
+  static Metrics _S_Metrics;
+  return _S_Metrics;
+}
+
+void Metrics::
+message_sent(unsigned int type, size_t bytes)
+{
+  _M_Messages[sent][type & 0xff]++;
+  _M_Bytes[sent][type & 0xff] += bytes;
+}
+
+void Metrics::
+message_received(unsigned int type, size_t bytes)
+{
+  _M_Messages[received][type & 0xff]++;
+  _M_Bytes[received][type & 0xff] += bytes;
+}
+
+void Metrics::
+sync_latency(const string& wp, double seconds)
+{
+  _M_Latency[wp].observe(seconds);
+}
+
+void Metrics::
+rsync_patched(size_t literal, size_t matched)
+{
+  _M_Literal += literal;
+  _M_Matched += matched;
+}
+
+void Metrics::
+hashed(size_t bytes, double seconds)
+{
+  _M_Hashed      += bytes;
+  _M_HashSeconds += seconds;
+}
+
+
+void Metrics::
+listen(const string& path)
+{
+  if (path == _M_Path && (_M_Endpoint || path.empty()))
+    return;
+
+  delete _M_Endpoint;
+  _M_Endpoint = NULL;
+  _M_Path     = path;
+
+  if (path.empty())
+    return;
+
+  struct sockaddr_un addr;
+  if (path.length() >= sizeof(addr.sun_path)) {
+    lc.error("metrics_socket %s is too long", path.c_str());
+    return;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  // the socket of a former fexd
+  struct stat buf;
+  if (lstat(path.c_str(), &buf) == 0 && S_ISSOCK(buf.st_mode))
+    ::unlink(path.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    // only root may read the metrics
+    mode_t mask = umask(077);
+    int    result = ::bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+
+    if (result < 0 || ::listen(fd, 16) < 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0) {
+    lc.error("cannot serve the metrics on %s (%s)", 
+	     path.c_str(), strerror(errno));
+    return;
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  _M_Endpoint = new MetricsEndpoint(fd, path);
+  lc.notice("metrics are served on %s", path.c_str());
+}
+
+
+static void
+append(string& out, const char* format, ...)
+{
+  char    buffer[512];
+  va_list args;
+
+  va_start(args, format);
+  int size = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (size < (int)sizeof(buffer)) {
+    if (size > 0)
+      out.append(buffer, size);
+    return;
+  }
+
+  // a long watchpoint path
+  vector<char> large(size + 1);
+  va_start(args, format);
+  vsnprintf(&large.front(), large.size(), format, args);
+  va_end(args);
+  out.append(&large.front(), size);
+}
+
+static void
+header(string& out, const char* name, const char* type, const char* help)
+{
+  append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// a label value in the quotes of the text format
+static string
+label(const string& value)
+{
+  string result;
+  for(size_t i = 0; i < value.length(); i++) {
+    switch(value[i]) {
+    case '\\': result += "\\\\"; break;
+    case '"' : result += "\\\""; break;
+    case '\n': result += "\\n";  break;
+    default  : result += value[i];
+    }
+  }
+  return result;
+}
+
+static string
+type_label(unsigned int type)
+{
+  const char* name = message_str(type);
+  if (name)
+    return name;
+
+  char number[8];
+  snprintf(number, sizeof(number), "%u", type);
+  return number;
+}
+
+string Metrics::
+render() const
+{
+  string out;
+  const char* direction[2] = { "sent", "received" };
+
+  header(out, "fex_messages_total", "counter",
+	 "Messages exchanged with the peers by type.");
+  for(int d = sent; d <= received; d++) {
+    for(unsigned int t = 0; t < 256; t++) {
+      if (_M_Messages[d][t])
+	append(out, "fex_messages_total{direction=\"%s\",type=\"%s\"} %llu\n",
+	       direction[d], type_label(t).c_str(), _M_Messages[d][t]);
+    }
+  }
+
+  header(out, "fex_message_bytes_total", "counter",
+	 "Uncompressed bytes of the messages by type.");
+  for(int d = sent; d <= received; d++) {
+    for(unsigned int t = 0; t < 256; t++) {
+      if (_M_Messages[d][t])
+	append(out, "fex_message_bytes_total{direction=\"%s\",type=\"%s\"} "
+	       "%llu\n", direction[d], type_label(t).c_str(), _M_Bytes[d][t]);
+    }
+  }
+
+  unsigned long long in  = _M_CompressIn;
+  unsigned long long out_bytes = _M_CompressOut;
+  header(out, "fex_compression_input_bytes_total", "counter",
+	 "Payload bytes offered to the compression.");
+  append(out, "fex_compression_input_bytes_total %llu\n", in);
+  header(out, "fex_compression_output_bytes_total", "counter",
+	 "Payload bytes after the compression.");
+  append(out, "fex_compression_output_bytes_total %llu\n", out_bytes);
+  header(out, "fex_compression_ratio", "gauge",
+	 "Compressed size of all compressed payloads by their size.");
+  append(out, "fex_compression_ratio %g\n", 
+	 in ? (double)out_bytes / in : 1.0);
+
+  header(out, "fex_rsync_literal_bytes_total", "counter",
+	 "Bytes of patched files sent literally by the peer.");
+  append(out, "fex_rsync_literal_bytes_total %llu\n", _M_Literal);
+  header(out, "fex_rsync_matched_bytes_total", "counter",
+	 "Bytes of patched files copied from the old version.");
+  append(out, "fex_rsync_matched_bytes_total %llu\n", _M_Matched);
+
+  header(out, "fex_hash_bytes_total", "counter",
+	 "Bytes read to compute the md4 sums of files.");
+  append(out, "fex_hash_bytes_total %llu\n", _M_Hashed);
+  header(out, "fex_hash_seconds_total", "counter",
+	 "Time spent computing the md4 sums of files.");
+  append(out, "fex_hash_seconds_total %g\n", _M_HashSeconds);
+
+  header(out, "fex_sync_latency_seconds", "histogram",
+	 "Age of the oldest change, when the peer acknowledged "
+	 "its synchronisation.");
+  Histogram_m::const_iterator h;
+  for(h = _M_Latency.begin(); h != _M_Latency.end(); h++) {
+    string wp = label(h->first);
+    unsigned long long count = 0;
+    for(int i = 0; i < Histogram::buckets; i++) {
+      count += h->second.count[i];
+      append(out, "fex_sync_latency_seconds_bucket{watchpoint=\"%s\","
+	     "le=\"%g\"} %llu\n", wp.c_str(), Histogram::bounds[i], count);
+    }
+
+    count += h->second.count[Histogram::buckets];
+    append(out, "fex_sync_latency_seconds_bucket{watchpoint=\"%s\","
+	   "le=\"+Inf\"} %llu\n", wp.c_str(), count);
+    append(out, "fex_sync_latency_seconds_sum{watchpoint=\"%s\"} %g\n", 
+	   wp.c_str(), h->second.sum);
+    append(out, "fex_sync_latency_seconds_count{watchpoint=\"%s\"} %llu\n", 
+	   wp.c_str(), count);
+  }
+
+  // the current state of the watchpoints
+  string states, depth, pending, age;
+  ntime  now = ntime::now();
+
+  const Configuration::WatchPoint_v& wps = 
+    Configuration::get().watch_points();
+  Configuration::WatchPoint_v::const_iterator w;
+  for(w = wps.begin(); w != wps.end(); w++) {
+    string wp = label((*w)->path());
+    size_t max_depth = 0, changes = 0;
+    double oldest = 0;
+
+    WatchPoint::sink_set::const_iterator s;
+    for(s = (*w)->sinks().begin(); s != (*w)->sinks().end(); s++) {
+      max_depth = max(max_depth, (*s)->dialog_depth());
+      changes  += (*s)->pending();
+      ntime since = (*s)->pending_since();
+      if (since)
+	oldest = max(oldest, (now - since).to_usecs() / 1000000.0);
+    }
+
+    append(states, "fex_statelog_entries{watchpoint=\"%s\"} %lu\n",
+	   wp.c_str(), (unsigned long)(*w)->size());
+    append(depth, "fex_dialog_depth{watchpoint=\"%s\"} %lu\n",
+	   wp.c_str(), (unsigned long)max_depth);
+    append(pending, "fex_pending_changes{watchpoint=\"%s\"} %lu\n",
+	   wp.c_str(), (unsigned long)changes);
+    append(age, "fex_pending_age_seconds{watchpoint=\"%s\"} %g\n",
+	   wp.c_str(), oldest);
+  }
+
+  header(out, "fex_statelog_entries", "gauge",
+	 "Paths known in the state log of the watchpoint.");
+  out += states;
+  header(out, "fex_dialog_depth", "gauge",
+	 "Deepest dialog stack of the connections of the watchpoint.");
+  out += depth;
+  header(out, "fex_pending_changes", "gauge",
+	 "Changes not yet acknowledged by the peers of the watchpoint.");
+  out += pending;
+  header(out, "fex_pending_age_seconds", "gauge",
+	 "Age of the oldest change not yet acknowledged by a peer.");
+  out += age;
+
+  return out;
+}
@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstdatomic>
+#include <string>
+#include <vector>
+#include <map>
+
+class MetricsEndpoint;
+
+
+/*
+  The counters and histograms of fexd. They are served in the
+  Prometheus text format on a local unix socket (see metrics_socket
+  in fex.conf). Everything is updated by the MainLoop thread, except
+  the compression counters, which the network threads update too.
+  The state of the watchpoints (StateLog sizes, dialog depth, pending
+  changes) is collected when the metrics are read.
+*/
+class Metrics
+{
+public:
+  static Metrics&
+  get();
+
+  void
+  message_sent(unsigned int type, size_t bytes);
+
+  void
+  message_received(unsigned int type, size_t bytes);
+
+  // the age of the oldest change of an acknowledged synchronisation
+  void
+  sync_latency(const std::string& wp, double seconds);
+
+  void
+  rsync_patched(size_t literal, size_t matched);
+
+  void
+  hashed(size_t bytes, double seconds);
+
+  // thread safe
+  void
+  compressed(size_t in, size_t out)
+  {
+    _M_CompressIn  += in;
+    _M_CompressOut += out;
+  }
+
+  // serves the metrics on a unix socket, an empty path closes it
+  void
+  listen(const std::string& path);
+
+  std::string
+  render() const;
+
+private:
+  struct Histogram
+  {
+    enum { buckets = 12 };
+    static const double bounds[buckets];
+
+    unsigned long long count[buckets + 1]; // the last one is +Inf
+    double             sum;
+
+    Histogram();
+
+    void
+    observe(double value);
+  };
+
+  typedef std::map<std::string, Histogram> Histogram_m;
+  typedef std::atomic<unsigned long long>  counter;
+
+  Metrics();
+  ~Metrics();
+
+  enum { sent, received };
+
+  unsigned long long _M_Messages[2][256];
+  unsigned long long _M_Bytes[2][256];
+  Histogram_m        _M_Latency;
+  unsigned long long _M_Literal;
+  unsigned long long _M_Matched;
+  unsigned long long _M_Hashed;
+  double             _M_HashSeconds;
+  counter            _M_CompressIn;
+  counter            _M_CompressOut;
+  std::string        _M_Path;
+  MetricsEndpoint*   _M_Endpoint;
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
@@ -21,12 +21,25 @@
  ***************************************************************************/
 #include "logging.h"
 #include "modlog.h"
+#include "metrics.h"
 #include "nmstl/debug"
+#include "nmstl/ntime"
+#include "nmstl/ioevent"
+#include "nmstl/thread"
 #include <fstream>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <signal.h>
+#include <deque>
+#include <vector>
 extern "C" {
 #include <librsync.h>
 }
@@ -46,23 +59,137 @@ struct rs_mdfour {
     unsigned char       tail[64];
 };
 
-// declared but not implemented in librsync
-static void
-mdfour_file(ifstream& in, unsigned char *result)
+// files are read and copied in chunks of this size
+static const size_t io_chunk_size = 256 * 1024;
+
+static char*
+io_buffer()
+{
+  static char* buffer = new char[io_chunk_size];
+  return buffer;
+}
+
+
+// declared but not implemented in librsync; buffer holds io_chunk_size
+// bytes. Returns the bytes read.
+static size_t
+mdfour_file(int dir_fd, const char* path, unsigned char *result, 
+	    char* buffer)
 {
   rs_mdfour_t md;
-  char        buffer[1024];
-  size_t      size;
+  ssize_t     size;
+  size_t      total = 0;
 
   rs_mdfour_begin(&md);
 
-  while(in.good()) {
-    in.read(buffer, sizeof(buffer));
-    size = in.gcount();
-    rs_mdfour_update(&md, buffer, size);
+  int fd = ::openat(dir_fd, path, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while((size = ::read(fd, buffer, io_chunk_size)) != 0) {
+      if (size < 0) {
+	if (errno == EINTR) continue;
+	break;
+      }
+      rs_mdfour_update(&md, buffer, size);
+      total += size;
+    }
+
+    ::close(fd);
   }
 
   rs_mdfour_result(&md, result);
+  return total;
+}
+
+
+/*
+  Copies the data of in to out inside the kernel. Returns false if
+  the filesystems do not support it, the offsets of both files are
+  left behind the copied data.
+*/
+static bool
+copy_in_kernel(int in, int out)
+{
+#ifdef FICLONE
+  // a reflink shares the blocks (btrfs, xfs)
+  if (ioctl(out, FICLONE, in) == 0)
+    return true;
+#endif
+
+#ifdef SYS_copy_file_range
+  struct stat buf;
+  if (fstat(in, &buf) < 0)
+    return false;
+
+  off_t left = buf.st_size;
+  while(left > 0) {
+    ssize_t size = syscall(SYS_copy_file_range, in, NULL, out, NULL, 
+			   (size_t)min(left, (off_t)1 << 30), 0);
+    if (size < 0 && errno == EINTR)
+      continue;
+
+    if (size <= 0)
+      // not supported (or the file shrank), copy the rest by hand
+      return false;
+
+    left -= size;
+  }
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+// copies from to the new file to, returns errno if a file can't be opened
+static int
+copy_file(const char* from, const char* to)
+{
+  char*   buffer = io_buffer();
+  ssize_t size;
+
+  int in = ::open(from, O_RDONLY);
+  if (in < 0) return errno;
+
+  int out = ::open(to, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (out < 0) {
+    int error = errno;
+    ::close(in);
+    return error;
+  }
+
+  if (copy_in_kernel(in, out)) {
+    ::close(in);
+    ::close(out);
+    return 0;
+  }
+
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while((size = ::read(in, buffer, io_chunk_size)) != 0) {
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    for(char* p = buffer; size > 0; ) {
+      ssize_t written = ::write(out, p, size);
+      if (written < 0) {
+	if (errno == EINTR) continue;
+	size = -1;
+	break;
+      }
+      p    += written;
+      size -= written;
+    }
+
+    if (size < 0) break;
+  }
+
+  ::close(in);
+  ::close(out);
+  return 0;
 }
 
 
@@ -188,9 +315,265 @@ nullfunc(const string& path, const State& type)
 }
 
 
+/*
+  Hashes the files found by rescans in threads of its own, so a slow
+  disk does not stall the MainLoop. The results go back to the
+  MainLoop through a pipe, where StateLog::hashed applies them.
+*/
+class StateLog::Hasher : private io_handler
+{
+public:
+  static Hasher*
+  get()
+  { return _S_Hasher; }
+
+  static void
+  start(size_t count);
+
+  static void
+  stop();
+
+  // the following methods must be called in the MainLoop thread
+
+  void
+  hash(StateLog* log, const string& key, time_t mtime, off_t size);
+
+  void
+  forget(StateLog* log);
+
+private:
+  typedef deque<hashed_file>                 file_q;
+  typedef vector<hashed_file>                file_v;
+  typedef std::map<unsigned long, StateLog*> log_m;
+
+  Hasher();
+  ~Hasher();
+
+  static void*
+  run(void* self);
+
+  virtual void
+  ravail();
+
+  static Hasher*    _S_Hasher;
+
+  // MainLoop thread
+  log_m             _M_Logs;
+
+  // shared with the hashing threads
+  mutex             _M_Lock;
+  condition         _M_Work;
+  file_q            _M_Todo;
+  file_v            _M_Done;
+  bool              _M_Stopping;
+  iohandle          _M_Wake;
+  vector<pthread_t> _M_Threads;
+};
+
+extern io_event_loop MainLoop;
+
+StateLog::Hasher* StateLog::Hasher::_S_Hasher = NULL;
+
+
+StateLog::Hasher::
+Hasher() : io_handler(MainLoop)
+{
+  pair<iohandle, iohandle> ios = iohandle::pipe();
+  ios.first.set_blocking(false);
+  ios.second.set_blocking(false);
+
+  set_owned(true);
+  set_ioh(ios.first);
+  _M_Wake = ios.second;
+  _M_Stopping = false;
+  want_read(true);
+}
+
+StateLog::Hasher::
+~Hasher()
+{
+}
+
+void StateLog::Hasher::
+start(size_t count)
+{
+  if (_S_Hasher || ! count)
+    return;
+
+  _S_Hasher = new Hasher();
+
+  // signals are handled by the MainLoop thread only
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for(size_t i = 0; i < count; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &Hasher::run, _S_Hasher)) {
+      lc.error("cannot start hashing thread (%s)", strerror(errno));
+      break;
+    }
+
+    _S_Hasher->_M_Threads.push_back(thread);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (_S_Hasher->_M_Threads.empty()) {
+    delete _S_Hasher;
+    _S_Hasher = NULL;
+    return;
+  }
+
+  lc.notice("started %lu hashing threads", 
+	    (unsigned long)_S_Hasher->_M_Threads.size());
+}
+
+void StateLog::Hasher::
+stop()
+{
+  if (! _S_Hasher)
+    return;
+
+  locking(_S_Hasher->_M_Lock) {
+    _S_Hasher->_M_Stopping = true;
+    _S_Hasher->_M_Work.broadcast();
+  }
+
+  vector<pthread_t>::iterator i;
+  for(i = _S_Hasher->_M_Threads.begin(); 
+      i != _S_Hasher->_M_Threads.end(); i++)
+    pthread_join(*i, NULL);
+
+  delete _S_Hasher;
+  _S_Hasher = NULL;
+}
+
+void StateLog::Hasher::
+hash(StateLog* log, const string& key, time_t mtime, off_t size)
+{
+  _M_Logs[log->_M_HashId] = log;
+
+  hashed_file file;
+  file.log   = log->_M_HashId;
+  file.key   = key;
+  file.mtime = mtime;
+  file.size  = size;
+
+  locking(_M_Lock) {
+    _M_Todo.push_back(file);
+    _M_Work.signal();
+  }
+}
+
+void StateLog::Hasher::
+forget(StateLog* log)
+{
+  // the files in work are dropped by ravail
+  _M_Logs.erase(log->_M_HashId);
+
+  locking(_M_Lock) {
+    file_q::iterator i;
+    for(i = _M_Todo.begin(); i != _M_Todo.end();) {
+      if (i->log == log->_M_HashId)
+	i = _M_Todo.erase(i);
+      else
+	i++;
+    }
+  }
+}
+
+void*
+StateLog::Hasher::
+run(void* self)
+{
+  Hasher* hasher = (Hasher*)self;
+  char*   buffer = new char[io_chunk_size];
+
+  for(;;) {
+    hashed_file file;
+    locking(hasher->_M_Lock) {
+      while(hasher->_M_Todo.empty() && ! hasher->_M_Stopping)
+	hasher->_M_Work.wait(hasher->_M_Lock);
+
+      if (hasher->_M_Stopping)
+	break;
+
+      file = hasher->_M_Todo.front();
+      hasher->_M_Todo.pop_front();
+    }
+
+    ntime start  = ntime::now();
+    file.bytes   = mdfour_file(AT_FDCWD, file.key.c_str(), file.md4, buffer);
+    file.seconds = (ntime::now() - start).to_usecs() / 1000000.0;
+
+    bool wake;
+    locking(hasher->_M_Lock) {
+      wake = hasher->_M_Done.empty();
+      hasher->_M_Done.push_back(file);
+    }
+
+    // only the first file of a batch needs a wake up
+    if (wake)
+      hasher->_M_Wake.write("A", 1);
+  }
+
+  delete[] buffer;
+  return NULL;
+}
+
+void StateLog::Hasher::
+ravail()
+{
+  char garbage[128];
+  while(get_ioh().read(garbage, sizeof(garbage)) == sizeof(garbage));
+
+  file_v done;
+  locking(_M_Lock) {
+    done.swap(_M_Done);
+  }
+
+  file_v::iterator i;
+  for(i = done.begin(); i != done.end(); i++) {
+    Metrics::get().hashed(i->bytes, i->seconds);
+
+    log_m::iterator log = _M_Logs.find(i->log);
+    if (log != _M_Logs.end())
+      log->second->hashed(*i);
+  }
+}
+
+
+/***************************************************************************/
+
 StateLog::
 StateLog()
 {
+  static unsigned long next_id = 0;
+
+  _M_HashId  = ++next_id;
+  _M_Scanned = false;
+  _M_Rescanning = false;
+  _M_Hashed  = NULL;
+}
+
+StateLog::
+~StateLog()
+{
+  if (Hasher::get())
+    Hasher::get()->forget(this);
+}
+
+void StateLog::
+start_hashing(size_t count)
+{
+  Hasher::start(count);
+}
+
+void StateLog::
+stop_hashing()
+{
+  Hasher::stop();
 }
 
 
@@ -209,6 +592,7 @@ backup(const string& full_path)
 {
   size_t ext_pos  = full_path.rfind('.');
   string base     = full_path.substr(0, ext_pos) + "-";
+  string ext      = ext_pos == string::npos ? "" : full_path.substr(ext_pos);
   int    revision = 0;
   State  state;
 
@@ -216,47 +600,79 @@ backup(const string& full_path)
   assert(i != end());
   memcpy(&state, &i->second, sizeof(state));
 
-  // find other backup files and extract the highest revision number
-  for(i = lower_bound(base); i != end(); i++) {
-    string pa(i->first.str());
-
-    if (strncmp(pa.c_str(), base.c_str(), base.length()))
-      break;
-
-    const char* p = pa.c_str() + base.length();
-    const char* s = p;
-    p--;
-    while(isdigit(*(++p)));
-
-    if (ext_pos == string::npos || full_path.substr(ext_pos) == p) {
-      // found a revision
-      revision = max(atoi(s), revision);
-      if (memcmp(state.md4, i->second.md4, sizeof(state.md4)) == 0) {
-	// the backup does already exists ==> do not backup again
+  string key = base + '*' + ext;
+  revision_m::iterator known = _M_Revisions.find(key);
+
+  if (known != _M_Revisions.end()) {
+    // only the revisions up to the last one can exist
+    revision = known->second;
+    for(int r = revision; r > 0; r--) {
+      char number[16];
+      snprintf(number, sizeof(number), "%i", r);
+      i = find(base + number + ext);
+      if (i != end() && memcmp(state.md4, i->second.md4, sizeof(state.md4)) == 0) {
 	lc.debug("don't backup %s because %s has same content", 
-		 full_path.c_str(), pa.c_str());
+		 full_path.c_str(), i->first.str().c_str());
 	return;
       }
     }
   }
+  else {
+    // find other backup files and extract the highest revision number
+    for(i = lower_bound(base); i != end(); i++) {
+      string pa(i->first.str());
+
+      if (strncmp(pa.c_str(), base.c_str(), base.length()))
+	break;
+
+      const char* p = pa.c_str() + base.length();
+      const char* s = p;
+      p--;
+      while(isdigit(*(++p)));
+
+      if (ext_pos == string::npos || ext == p) {
+	// found a revision
+	revision = max(atoi(s), revision);
+	if (memcmp(state.md4, i->second.md4, sizeof(state.md4)) == 0) {
+	  // the backup does already exists ==> do not backup again
+	  // the scan may not have reached the highest revision, 
+	  // so nothing is cached
+	  lc.debug("don't backup %s because %s has same content", 
+		   full_path.c_str(), pa.c_str());
+	  return;
+	}
+      }
+    }
+  }
   
-  // construct new file name and rename the file
-  base += to_string(revision + 1);
-  if (ext_pos != string::npos)
-    base += full_path.substr(ext_pos);
+  /*
+    construct new file name and rename the file. A revision unknown
+    to the state log (e.g. not yet scanned) is never overwritten, 
+    the next number is taken instead.
+  */
+  string prefix(base);
+  for(;;) {
+    char number[16];
+    snprintf(number, sizeof(number), "%i", ++revision);
+    base = prefix + number + ext;
+
+    if (S_ISDIR(state.mode)) {
+      struct stat buf;
+      if (lstat(base.c_str(), &buf) == 0)
+	continue;
 
-  if (S_ISDIR(state.mode)) 
-    ::rename(full_path.c_str(), base.c_str());
-  else {
-    ifstream in (full_path.c_str(), ios_base::binary|ios_base::in);
-    ofstream out(base.c_str(), ios_base::binary|ios_base::out);
-    out << in.rdbuf();
-    in.close();
-    out.close();
+      ::rename(full_path.c_str(), base.c_str());
+      iterator item = find(full_path);
+      renewState(full_path, item);
+      break;
+    }
+
+    if (copy_file(full_path.c_str(), base.c_str()) != EEXIST)
+      break;
   }
 
-  iterator item = find(full_path);
-  renewState(full_path, item);
+  _M_Revisions[key] = revision;
+
   state.mode &= ~(S_IWUSR | S_IWGRP | S_IROTH);
   chmod(base.c_str(), state.mode);
   chown(base.c_str(), state.uid, state.gid);
@@ -274,11 +690,59 @@ changeDB(const string& path, const unsigned char* md4)
   testPath(buffer);
   buffer += "/";
   walkTree(buffer);
+  _M_Scanned = true;
 }
 
+void StateLog::
+rescan(const string& path)
+{
+  /*
+    The files of a rescan may be hashed by the Hasher. Not those of
+    changeDB: an edit reported by an event must be in the log before
+    a peer's version of the file arrives, or it is overwritten
+    without a backup.
+  */
+  string buffer(path);
+  _M_Rescanning = true;
+  testPath(buffer);
+  buffer += "/";
+  walkTree(buffer, true);
+  _M_Rescanning = false;
+  _M_Scanned = true;
+}
+
+
+void StateLog::
+hashed(const hashed_file& file)
+{
+  _M_Hashing.erase(file.key);
+
+  struct stat buf;
+  if (! isValidPath(file.key) || 
+      lstat(file.key.c_str(), &buf) < 0 || ! S_ISREG(buf.st_mode)) {
+    // removed or replaced meanwhile, the next walk or event sees it
+    return;
+  }
+
+  if (buf.st_mtime != file.mtime || buf.st_size != file.size) {
+    // changed while hashing
+    if (_M_Hashing.insert(file.key).second)
+      Hasher::get()->hash(this, file.key, buf.st_mtime, buf.st_size);
+    return;
+  }
+
+  iterator item = find(file.key);
+  if (item != end() && 
+      item->second.mtime == file.mtime && item->second.size == file.size)
+    return;
+
+  _M_Hashed = &file;
+  testPath(file.key);
+  _M_Hashed = NULL;
+}
 
 unsigned int StateLog::
-renewState(const string& key, iterator& item)
+renewState(const string& key, iterator& item, int dir_fd, const char* name)
 {
   unsigned int result = 0;
   State        sbuf;
@@ -292,8 +756,12 @@ renewState(const string& key, iterator& item)
     memset(state, 0, sizeof(*state));
 
 
+  // name is relative to dir_fd, if the caller has the directory open
+  if (! name) 
+    name = key.c_str();
+
   struct stat buf;
-  if (lstat(key.c_str(), &buf) < 0) {
+  if (fstatat(dir_fd, name, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
     // path was removed
     if (state->mode != 0) {
       state->action = result = 
@@ -315,9 +783,34 @@ renewState(const string& key, iterator& item)
 
   if (buf.st_mtime > state->mtime ||
       buf.st_size != state->size) {
+    if (_M_Rescanning && _M_Scanned && S_ISREG(state->mode) 
+	&& Hasher::get()) {
+      /*
+        A file found by a rescan is hashed by the Hasher, hashed
+        applies it. Until then the old state stays in place.
+      */
+      if (_M_Hashing.insert(key).second)
+	Hasher::get()->hash(this, key, buf.st_mtime, buf.st_size);
+
+      if (item == end())
+	return 0;
+
+      if (result)
+	state->action = result;
+      return result;
+    }
+
     if (! S_ISDIR(state->mode)) {
-      ifstream in(key.c_str(), ios::in|ios::binary);
-      mdfour_file(in, state->md4);
+      if (_M_Hashed && _M_Hashed->key == key && 
+	  _M_Hashed->mtime == buf.st_mtime && 
+	  _M_Hashed->size  == buf.st_size)
+	memcpy(state->md4, _M_Hashed->md4, sizeof(state->md4));
+      else {
+	ntime  start = ntime::now();
+	size_t bytes = mdfour_file(dir_fd, name, state->md4, io_buffer());
+	Metrics::get().hashed(bytes, 
+			      (ntime::now() - start).to_usecs() / 1000000.0);
+      }
       result = S_ISLNK(state->mode) ? State::newlink : State::changed;
     }
 
@@ -349,58 +842,82 @@ renewState(const string& key, iterator& item)
 }
 
 void StateLog::
-walkTree(string& full_path)
+walkTree(string& full_path, bool all)
 {
-  int length = full_path.length();
+  int fd = ::open(full_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    walkDir(full_path, fd, all);
+}
 
-  DIR* dirf = opendir(full_path.c_str());
-  if (dirf) {
-    struct dirent *item;
+void StateLog::
+walkDir(string& full_path, int fd, bool all)
+{
+  /*
+    The entries are examined relative to the open directory fd, so the
+    kernel does not resolve the whole path for every entry.
+  */
+  DIR* dirf = fdopendir(fd);
+  if (! dirf) {
+    ::close(fd);
+    return;
+  }
 
-    while(item = readdir(dirf)) {
-      if (item->d_name[0] == '.' && item->d_name[1] == '.' ||
-	  item->d_name[0] == '.' && item->d_name[1] == 0)
-	continue;
+  int length = full_path.length();
+  struct dirent *item;
 
-      full_path.erase(length);
-      full_path += item->d_name;
+  while(item = readdir(dirf)) {
+    if (item->d_name[0] == '.' && item->d_name[1] == '.' ||
+	item->d_name[0] == '.' && item->d_name[1] == 0)
+      continue;
 
-      if (! isValidPath(full_path))
-	continue;
+    full_path.erase(length);
+    full_path += item->d_name;
+
+    if (! isValidPath(full_path))
+      continue;
 
-      int result = testPath(full_path);
+    int result = testPath(full_path, dirfd(dirf), item->d_name);
 
+    // d_type spares the stat, only some file systems leave it unknown
+    bool is_dir = item->d_type == DT_DIR;
+    if (item->d_type == DT_UNKNOWN) {
       struct stat buf;
-      lstat(full_path.c_str(), &buf);
-      if (S_ISDIR(buf.st_mode)) {
-	if ((result & (State::mkdired)) == 0) {
-	  // test if the next item in this directory is removed
-	  full_path += (char)('/' + 1);
-	  iterator i = lower_bound(full_path);
-	  if (i != end())
-	    testPath(i->first.str());
-
-	  continue;
-	}
+      is_dir = fstatat(dirfd(dirf), item->d_name, &buf, 
+		       AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(buf.st_mode);
+    }
 
-	full_path += "/";
-	walkTree(full_path);
+    if (is_dir) {
+      if ((result & (State::mkdired)) == 0 && ! all) {
+	// test if the next item in this directory is removed
+	full_path += (char)('/' + 1);
+	iterator i = lower_bound(full_path);
+	if (i != end())
+	  testPath(i->first.str());
+
+	continue;
       }
-    }
 
-    closedir(dirf);
+      full_path += "/";
+      if (! isExcludedTree(full_path)) {
+	int sub = ::openat(dirfd(dirf), item->d_name, 
+			   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (sub >= 0)
+	  walkDir(full_path, sub, all);
+      }
+    }
   }
-		
+
+  closedir(dirf);
   full_path.erase(length);
 }
 
 unsigned int StateLog::
-testPath(const string& path)
+testPath(const string& path, int dir_fd, const char* name)
 {
   State state;
 
   iterator item = find(path);
-  int result = renewState(path, item);
+  int result = renewState(path, item, dir_fd, name);
   
   if (item == end()) {
     // only possible if peer sends a wrong notifcation
@@ -465,8 +982,8 @@ find_path(ino_t inode, dev_t device, std::string& path) const
   for(i = begin(); i != end(); i++) {
     struct stat buf;
     string p = i->first.str();
-    lstat(p.c_str(), &buf);
-    if (buf.st_dev = device && buf.st_ino == inode) {
+    if (lstat(p.c_str(), &buf) == 0
+	&& buf.st_dev == device && buf.st_ino == inode) {
       path = p;
       return true;
     }
@@ -23,7 +23,10 @@
 #define MODLOG_H
 
 #include <string.h>
+#include <fcntl.h>
 #include <map>
+#include <set>
+#include <string>
 
 
 /*
@@ -116,6 +119,7 @@ public:
   parent::clear;
   parent::erase;
   parent::empty;
+  parent::size;
 
   ModLog();
 
@@ -146,6 +150,17 @@ class StateLog : protected ModLog
 {
 public:
   StateLog();
+  virtual ~StateLog();
+
+  ModLog::size;
+
+  // hashes the files found by rescans in count threads, 0 hashes
+  // in the MainLoop
+  static void
+  start_hashing(size_t count);
+
+  static void
+  stop_hashing();
 
   void 
   changeDB(const std::string& path, const unsigned char* md4 = NULL);
@@ -153,6 +168,10 @@ public:
   bool
   find_path(ino_t inode, dev_t device, std::string& path) const;
 
+  // like changeDB, but descends into the known directories too
+  void
+  rescan(const std::string& path);
+
 #ifndef NDEBUG
   std::ostream&
   dump(std::ostream& out);
@@ -165,23 +184,65 @@ protected:
   virtual bool
   isValidPath(const std::string& path) const = 0;
 
+  // true if nothing below dir (ending with '/') is monitored
+  virtual bool
+  isExcludedTree(const std::string& dir) const = 0;
+
   void
   backup(const std::string& path);
 
 private:
   typedef parent::iterator iterator;
 
+  class Hasher;
+
+  // a file hashed by the Hasher
+  struct hashed_file {
+    unsigned long log;   // the _M_HashId of the StateLog
+    std::string   key;
+    time_t        mtime;
+    off_t         size;
+    size_t        bytes;
+    double        seconds;
+    unsigned char md4[16];
+  };
+
+  // applies a hash of the Hasher (MainLoop)
+  void
+  hashed(const hashed_file& file);
+
   unsigned int
-  renewState(const std::string& key, iterator& item);
+  renewState(const std::string& key, iterator& item, 
+	     int dir_fd = AT_FDCWD, const char* name = NULL);
 
   void 
-  walkTree(std::string& path);
+  walkTree(std::string& path, bool all = false);
+
+  // walks the directory fd (closed afterwards) named path
+  void 
+  walkDir(std::string& path, int fd, bool all);
 
   unsigned int
-  testPath(const std::string& path);
+  testPath(const std::string& path, 
+	   int dir_fd = AT_FDCWD, const char* name = NULL);
   
   void
   validateMD4(const std::string& path, const unsigned char* md4);
+
+  // the last backup revision of a name ("base-*.ext")
+  typedef std::map<std::string, int> revision_m;
+
+  revision_m _M_Revisions;
+
+  typedef std::set<std::string> key_s;
+
+  unsigned long      _M_HashId;
+  bool               _M_Scanned;   // the first walk is done
+  bool               _M_Rescanning;
+  key_s              _M_Hashing;   // the keys waiting for the Hasher
+  const hashed_file* _M_Hashed;    // applied by renewState
+
+  friend class Hasher;
 };
 
 
@@ -0,0 +1,471 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "logging.h"
+#include "netthread.h"
+#include <algorithm>
+#include <signal.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace nmstl;
+
+extern io_event_loop MainLoop;
+
+
+NetMailbox::
+NetMailbox(io_event_loop& loop)
+  : io_handler(loop)
+{
+  pair<iohandle, iohandle> ios = iohandle::pipe();
+  ios.first.set_blocking(false);
+  ios.second.set_blocking(false);
+
+  set_owned(true);
+  set_ioh(ios.first);
+  _M_Wake = ios.second;
+  want_read(true);
+}
+
+NetMailbox::
+~NetMailbox()
+{
+}
+
+void NetMailbox::
+post(NetEvent& event)
+{
+  bool wake;
+
+  locking(_M_Lock) {
+    wake = _M_Events.empty();
+    _M_Events.push_back(NetEvent());
+    NetEvent& ev = _M_Events.back();
+    ev.type    = event.type;
+    ev.channel = event.channel;
+    ev.head    = event.head;
+    ev.value   = event.value;
+    ev.bytes   = event.bytes;
+    ev.transport = event.transport;
+    ev.data.swap(event.data);
+  }
+
+  // only the first event of a batch needs a wake up
+  if (wake)
+    _M_Wake.write("A", 1);
+}
+
+void NetMailbox::
+ravail()
+{
+  char garbage[128];
+  while(get_ioh().read(garbage, sizeof(garbage)) == sizeof(garbage));
+
+  locking(_M_Lock) {
+    _M_Delivering.swap(_M_Events);
+  }
+
+  events_v::iterator i;
+  for(i = _M_Delivering.begin(); i != _M_Delivering.end(); i++)
+    deliver(*i);
+
+  _M_Delivering.clear();
+  delivered();
+}
+
+
+/***************************************************************************/
+
+/*
+  The socket of a Connection inside a network thread.
+*/
+class NetChannel : public nmstl::msg_handler<fex_header>
+{
+public:
+  typedef nmstl::msg_handler<fex_header> parent;
+
+  NetChannel(NetThread& thread, unsigned long id, int fd, bool established,
+	     transport* tp)
+    : parent(thread._M_Loop), _M_Thread(thread), _M_Id(id),
+      _M_Written(0), _M_Closed(false), _M_WideIds(false),
+      _M_LongFrames(false)
+  {
+    set_owned(false);
+    set_socket(tcpsocket(iohandle(fd)), established);
+    if (tp && ! set_transport(tp))
+      closed(0, Z_OK);
+  }
+
+  ~NetChannel()
+  {
+    _M_Thread._M_Channels.erase(_M_Id);
+    if (! _M_Closed)
+      closed(0, Z_OK);
+  }
+
+  void
+  silence()
+  { _M_Closed = true; }
+
+  void
+  send(const fex_header& head, constbuf payload, int level)
+  {
+    if (_M_Closed)
+      return;
+
+    _M_Written += sizeof(head) + payload.length();
+
+    fex_header h(head);
+    if (_M_Compressor.compress(level, h, payload))
+      parent::write(h, payload);
+    else if (_M_Compressor.failed()) {
+      closed(0, Z_STREAM_ERROR);
+      set_socket(tcpsocket());
+    }
+    else
+      parent::write(head, payload);
+  }
+
+  void
+  report()
+  {
+    if (! _M_Closed && write_bytes_pending() == 0)
+      all_written();
+  }
+
+private:
+  virtual void
+  incoming_message(const fex_header &head, constbuf buf)
+  {
+    if (_M_Closed)
+      return;
+
+    NetEvent ev;
+    ev.type    = NetEvent::message;
+    ev.channel = _M_Id;
+    ev.head    = head;
+
+    constbuf ibuf(buf);
+    int      result;
+    _M_Compressor.decompress(ev.head, ibuf, result);
+    if (result != Z_OK) {
+      closed(0, result);
+      set_socket(tcpsocket());
+      return;
+    }
+
+    // the headers after the peer's start are read as it writes them
+    if (ev.head.type == ME_Start) {
+      _M_WideIds    = hasCapability(ibuf, "wpids");
+      _M_LongFrames = hasCapability(ibuf, "frames");
+    }
+
+    ev.data.assign(ibuf.data(), ibuf.length());
+    _M_Thread._M_ToMain->post(ev);
+  }
+
+  virtual void
+  prepare_header(fex_header& head)
+  { 
+    head.wide_ids    = _M_WideIds;
+    head.long_frames = _M_LongFrames;
+  }
+
+  virtual bool
+  accept_header(const fex_header& head)
+  {
+    if (_M_Closed || head.length <= fex_header::max_length())
+      return true;
+
+    closed(0, Z_DATA_ERROR);
+    set_socket(tcpsocket());
+    return false;
+  }
+
+  virtual void
+  end_messages(unsigned int remaining)
+  {
+    // the channel is deleted by net_handler afterwards
+    if (! _M_Closed)
+      closed(remaining, Z_OK);
+  }
+
+  virtual void
+  all_written()
+  {
+    NetEvent ev;
+    ev.type    = NetEvent::written;
+    ev.channel = _M_Id;
+    ev.bytes   = _M_Written;
+    ev.value   = _M_Compressor.throughput();
+    _M_Thread._M_ToMain->post(ev);
+  }
+
+  void
+  closed(size_t remaining, int error)
+  {
+    _M_Closed = true;
+
+    NetEvent ev;
+    ev.type    = NetEvent::closed;
+    ev.channel = _M_Id;
+    ev.bytes   = remaining;
+    ev.value   = error;
+    _M_Thread._M_ToMain->post(ev);
+  }
+
+  NetThread&        _M_Thread;
+  unsigned long     _M_Id;
+  size_t            _M_Written;
+  bool              _M_Closed;
+  bool              _M_WideIds;
+  bool              _M_LongFrames;
+  MessageCompressor _M_Compressor;
+};
+
+
+/***************************************************************************/
+
+/*
+  Events from the MainLoop, delivered in the network thread.
+*/
+class NetThread::ToNet : public NetMailbox
+{
+public:
+  ToNet(NetThread& thread)
+    : NetMailbox(thread._M_Loop), _M_Thread(thread)
+  { }
+
+private:
+  virtual void
+  deliver(NetEvent& ev)
+  {
+    if (ev.type == NetEvent::open) {
+      _M_Thread._M_Channels[ev.channel] =
+	new NetChannel(_M_Thread, ev.channel, ev.value, ev.bytes, ev.transport);
+      return;
+    }
+
+    Channel_m::iterator f = _M_Thread._M_Channels.find(ev.channel);
+    if (f == _M_Thread._M_Channels.end())
+      return; // already closed by the peer
+
+    NetChannel* channel = f->second;
+
+    switch(ev.type) {
+    case NetEvent::send:
+      channel->send(ev.head, constbuf(ev.data), ev.value);
+      _M_Thread._M_Touched.push_back(ev.channel);
+      break;
+
+    case NetEvent::close:
+      channel->silence();
+      delete channel;
+      break;
+    }
+  }
+
+  virtual void
+  delivered()
+  {
+    // report the data, the kernel accepted at once
+    vector<unsigned long>& touched = _M_Thread._M_Touched;
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+
+    vector<unsigned long>::iterator i;
+    for(i = touched.begin(); i != touched.end(); i++) {
+      Channel_m::iterator f = _M_Thread._M_Channels.find(*i);
+      if (f != _M_Thread._M_Channels.end())
+	f->second->report();
+    }
+
+    touched.clear();
+  }
+
+  NetThread& _M_Thread;
+};
+
+
+/*
+  Events from the network thread, delivered in the MainLoop.
+*/
+class NetThread::ToMain : public NetMailbox
+{
+public:
+  ToMain(NetThread& thread)
+    : NetMailbox(MainLoop), _M_Thread(thread)
+  { }
+
+private:
+  virtual void
+  deliver(NetEvent& ev)
+  {
+    Connection_m::iterator f = _S_Connections.find(ev.channel);
+    if (f == _S_Connections.end())
+      return; // the connection was closed meanwhile
+
+    Connection* con = f->second;
+
+    switch(ev.type) {
+    case NetEvent::message:
+      ev.head.length = ev.data.length();
+      con->incoming_message(ev.head, constbuf(ev.data));
+      break;
+
+    case NetEvent::written:
+      con->channelWritten(ev.bytes, ev.value);
+      break;
+
+    case NetEvent::closed:
+      _S_Connections.erase(f);
+      _M_Thread._M_Load--;
+      con->channelClosed(ev.bytes, ev.value);
+      break;
+    }
+  }
+
+  NetThread& _M_Thread;
+};
+
+
+/***************************************************************************/
+
+vector<NetThread*>      NetThread::_S_Threads;
+NetThread::Connection_m NetThread::_S_Connections;
+unsigned long           NetThread::_S_NextChannel = 0;
+
+
+NetThread::
+NetThread()
+{
+  _M_Load   = 0;
+  _M_ToMain = new ToMain(*this);
+  _M_ToNet  = new ToNet(*this);
+}
+
+NetThread::
+~NetThread()
+{
+  delete _M_ToNet;
+  delete _M_ToMain;
+}
+
+void NetThread::
+start(size_t count)
+{
+  // signals are handled by the MainLoop thread only
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for(size_t i = 0; i < count; i++) {
+    NetThread* thread = new NetThread();
+    if (pthread_create(&thread->_M_Thread, NULL, &NetThread::run, thread)) {
+      lc.error("cannot start network thread (%s)", strerror(errno));
+      delete thread;
+      break;
+    }
+
+    _S_Threads.push_back(thread);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (! _S_Threads.empty())
+    lc.notice("started %lu network threads", (unsigned long)_S_Threads.size());
+}
+
+void NetThread::
+stop()
+{
+  vector<NetThread*>::iterator i;
+  for(i = _S_Threads.begin(); i != _S_Threads.end(); i++) {
+    (*i)->_M_Loop.terminate();
+    pthread_join((*i)->_M_Thread, NULL);
+    delete *i;
+  }
+
+  _S_Threads.clear();
+  _S_Connections.clear();
+}
+
+void*
+NetThread::
+run(void* self)
+{
+  NetThread* thread = (NetThread*)self;
+  thread->_M_Loop.run();
+  thread->_M_Loop.tidy_handlers();
+  return NULL;
+}
+
+NetThread*
+NetThread::
+open(Connection* con, nmstl::socket sock, bool established,
+     nmstl::transport* transport, unsigned long& channel)
+{
+  // the least loaded thread gets the connection
+  vector<NetThread*>::iterator i;
+  NetThread* thread = _S_Threads.front();
+  for(i = _S_Threads.begin(); i != _S_Threads.end(); i++) {
+    if ((*i)->_M_Load < thread->_M_Load)
+      thread = *i;
+  }
+
+  channel = ++_S_NextChannel;
+  _S_Connections[channel] = con;
+  thread->_M_Load++;
+
+  NetEvent ev;
+  ev.type    = NetEvent::open;
+  ev.channel = channel;
+  ev.value   = ::dup(sock.get_fd());
+  ev.bytes   = established;
+  ev.transport = transport;
+  thread->_M_ToNet->post(ev);
+  return thread;
+}
+
+void NetThread::
+send(unsigned long channel, const fex_header& head, constbuf payload, int level)
+{
+  NetEvent ev;
+  ev.type    = NetEvent::send;
+  ev.channel = channel;
+  ev.head    = head;
+  ev.value   = level;
+  ev.data.assign(payload.data(), payload.length());
+  _M_ToNet->post(ev);
+}
+
+void NetThread::
+close(unsigned long channel)
+{
+  if (_S_Connections.erase(channel))
+    _M_Load--;
+
+  NetEvent ev;
+  ev.type    = NetEvent::close;
+  ev.channel = channel;
+  _M_ToNet->post(ev);
+}
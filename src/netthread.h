@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef NETTHREAD_H
+#define NETTHREAD_H
+
+#include "connection.h"
+#include "nmstl/thread"
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+
+
+/*
+  An event passed between the MainLoop thread and a network thread.
+*/
+struct NetEvent
+{
+  enum { open, send, close, message, written, closed };
+
+  NetEvent() : transport(NULL)
+  { }
+
+  int           type;
+  unsigned long channel;
+  fex_header    head;
+  std::string   data;   // payload of send and message
+  int           value;  // fd of open, compression level of send,
+                        // compression throughput of written,
+                        // zlib error of closed
+  size_t        bytes;  // of written (cumulated) and closed (remaining)
+  nmstl::transport* transport; // of open (owned by the channel)
+};
+
+
+/*
+  A queue of NetEvents, which is filled by any thread and emptied by
+  the event loop it is attached to. The loop is woken up by a pipe.
+*/
+class NetMailbox : private nmstl::io_handler
+{
+public:
+  typedef std::vector<NetEvent> events_v;
+
+  NetMailbox(nmstl::io_event_loop& loop);
+  virtual
+  ~NetMailbox();
+
+  void
+  post(NetEvent& event);
+
+protected:
+  virtual void
+  deliver(NetEvent& event) = 0;
+
+  virtual void
+  delivered()
+  { }
+
+private:
+  virtual void
+  ravail();
+
+  nmstl::mutex    _M_Lock;
+  events_v        _M_Events;
+  events_v        _M_Delivering;
+  nmstl::iohandle _M_Wake;
+};
+
+
+class NetChannel;
+
+/*
+  A thread with its own event loop, which does the socket I/O and the
+  (de)compression of Connections. The Connections and everything
+  behind them (WatchPoints, StateLogs, dialogs) stay in the MainLoop
+  thread, they only exchange complete messages with the network
+  thread.
+*/
+class NetThread
+{
+public:
+  static void
+  start(size_t count);
+
+  static void
+  stop();
+
+  static bool
+  active()
+  { return ! _S_Threads.empty(); }
+
+  // the following methods must be called in the MainLoop thread
+
+  static NetThread*
+  open(Connection* con, nmstl::socket sock, bool established,
+       nmstl::transport* transport, unsigned long& channel);
+
+  void
+  send(unsigned long channel, const fex_header& head,
+       nmstl::constbuf payload, int level);
+
+  void
+  close(unsigned long channel);
+
+private:
+  class ToNet;
+  class ToMain;
+  typedef std::map<unsigned long, Connection*> Connection_m;
+  typedef std::map<unsigned long, NetChannel*> Channel_m;
+
+  NetThread();
+  ~NetThread();
+
+  static void*
+  run(void* thread);
+
+  // MainLoop thread
+  static std::vector<NetThread*> _S_Threads;
+  static Connection_m            _S_Connections;
+  static unsigned long           _S_NextChannel;
+  size_t                         _M_Load;
+  NetMailbox*                    _M_ToMain;
+
+  // network thread
+  nmstl::io_event_loop           _M_Loop;
+  NetMailbox*                    _M_ToNet;
+  Channel_m                      _M_Channels;
+  std::vector<unsigned long>     _M_Touched;
+
+  pthread_t                      _M_Thread;
+
+  friend class NetChannel;
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "pathmatcher.h"
+#include <fnmatch.h>
+
+using namespace std;
+
+
+static inline bool
+is_wildcard(char c)
+{
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+/*
+  Returns the position after the wildcard at pos. A bracket may
+  contain ']' as its first member, in [:class:], [.symbol.] and
+  [=equivalent=], or escaped by a backslash.
+*/
+static size_t
+skip_wildcard(const string& text, size_t pos)
+{
+  size_t n = text.length();
+
+  switch(text[pos]) {
+  case '\\':
+    return min(pos + 2, n);
+
+  case '[': {
+    size_t i = pos + 1;
+    if (i < n && (text[i] == '!' || text[i] == '^'))
+      i++;
+    if (i < n && text[i] == ']')
+      i++;
+
+    while(i < n && text[i] != ']') {
+      if (text[i] == '[' && i + 1 < n 
+	  && (text[i + 1] == ':' || text[i + 1] == '.' || text[i + 1] == '=')) {
+	char   term[] = { text[i + 1], ']', 0 };
+	size_t end = text.find(term, i + 2);
+	if (end == string::npos)
+	  // not sure how fnmatch reads it, no literal follows
+	  return n;
+	i = end + 2;
+	continue;
+      }
+
+      if (text[i] == '\\')
+	i++;
+      i++;
+    }
+
+    // an unclosed bracket is a literal '['
+    return i >= n ? pos + 1 : i + 1;
+  }
+
+  default:
+    return pos + 1;
+  }
+}
+
+
+PathMatcher::
+PathMatcher()
+{
+}
+
+PathMatcher::pattern
+PathMatcher::
+compile(const string& text)
+{
+  pattern p;
+  p.glob = text;
+
+  size_t first = text.find_first_of("*?[\\");
+  if (first == string::npos) {
+    p.type    = exact;
+    p.literal = text;
+    return p;
+  }
+
+  size_t n = text.length();
+  size_t next = text.find_first_of("*?[\\", 1);
+
+  if (first == 0 && text[0] == '*' && next == string::npos) {
+    p.type    = suffix;
+    p.literal = text.substr(1);
+    return p;
+  }
+
+  if (first == n - 1 && text[n - 1] == '*') {
+    p.type    = prefix;
+    p.literal = text.substr(0, n - 1);
+    return p;
+  }
+
+  if (first == 0 && text[0] == '*' && next == n - 1 && text[n - 1] == '*') {
+    p.type    = infix;
+    p.literal = text.substr(1, n - 2);
+    return p;
+  }
+
+  // the longest run of literal characters prefilters fnmatch
+  p.type = glob;
+  size_t start = 0;
+  for(size_t i = 0; i <= n;) {
+    if (i == n || is_wildcard(text[i])) {
+      if (i - start > p.literal.length())
+	p.literal = text.substr(start, i - start);
+      if (i == n)
+	break;
+      i = start = skip_wildcard(text, i);
+      continue;
+    }
+    i++;
+  }
+
+  return p;
+}
+
+void PathMatcher::
+compile(const string_v& includes, const string_v& excludes)
+{
+  _M_Includes.clear();
+  _M_Excludes.clear();
+  _M_ExactIncludes.clear();
+  _M_ExactExcludes.clear();
+  _M_TreeExcludes.clear();
+  _M_IncludePrefixes.clear();
+
+  string_v::const_iterator i;
+  for(i = includes.begin(); i != includes.end(); i++) {
+    pattern p = compile(*i);
+    if (p.type == exact)
+      _M_ExactIncludes.insert(p.literal);
+    else
+      _M_Includes.push_back(p);
+
+    _M_IncludePrefixes.push_back(i->substr(0, i->find_first_of("*?[\\")));
+  }
+
+  for(i = excludes.begin(); i != excludes.end(); i++) {
+    pattern p = compile(*i);
+    if (p.type == exact)
+      _M_ExactExcludes.insert(p.literal);
+    else
+      _M_Excludes.push_back(p);
+
+    // "X*" excludes everything below a directory matching X, if the
+    // star is not escaped
+    size_t n = i->length();
+    size_t escapes = 0;
+    while(escapes + 1 < n && (*i)[n - 2 - escapes] == '\\')
+      escapes++;
+
+    if (n > 1 && (*i)[n - 1] == '*' && escapes % 2 == 0)
+      _M_TreeExcludes.push_back(i->substr(0, n - 1));
+  }
+}
+
+bool PathMatcher::
+match(const pattern_v& patterns, const set<string>& exacts, 
+      const string& path)
+{
+  if (! exacts.empty() && exacts.count(path))
+    return true;
+
+  pattern_v::const_iterator i;
+  for(i = patterns.begin(); i != patterns.end(); i++) {
+    const string& literal = i->literal;
+
+    switch(i->type) {
+    case prefix:
+      if (path.compare(0, literal.length(), literal) == 0)
+	return true;
+      break;
+
+    case suffix:
+      if (path.length() >= literal.length() 
+	  && path.compare(path.length() - literal.length(), 
+			  literal.length(), literal) == 0)
+	return true;
+      break;
+
+    case infix:
+      if (path.find(literal) != string::npos)
+	return true;
+      break;
+
+    default:
+      if (path.find(literal) != string::npos
+	  && fnmatch(i->glob.c_str(), path.c_str(), 0) == 0)
+	return true;
+      break;
+    }
+  }
+
+  return false;
+}
+
+bool PathMatcher::
+isValid(const string& path) const
+{
+  if (match(_M_Includes, _M_ExactIncludes, path))
+    return true;
+
+  return ! match(_M_Excludes, _M_ExactExcludes, path);
+}
+
+bool PathMatcher::
+isExcludedTree(const string& dir) const
+{
+  if (_M_TreeExcludes.empty())
+    return false;
+
+  // an include could match a path below dir
+  string_v::const_iterator i;
+  for(i = _M_IncludePrefixes.begin(); i != _M_IncludePrefixes.end(); i++) {
+    size_t n = min(i->length(), dir.length());
+    if (i->compare(0, n, dir, 0, n) == 0)
+      return false;
+  }
+
+  for(i = _M_TreeExcludes.begin(); i != _M_TreeExcludes.end(); i++) {
+    if (fnmatch(i->c_str(), dir.c_str(), 0) == 0)
+      return true;
+  }
+
+  return false;
+}
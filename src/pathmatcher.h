@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef PATHMATCHER_H
+#define PATHMATCHER_H
+
+#include <string>
+#include <vector>
+#include <set>
+
+
+/*
+  The include and exclude patterns of a watchpoint, compiled once. A
+  pattern without wildcards, or with wildcards only at its ends, is
+  matched by string comparison. The other patterns are given to
+  fnmatch only if the path contains their longest literal part.
+*/
+class PathMatcher
+{
+public:
+  typedef std::vector<std::string> string_v;
+
+  PathMatcher();
+
+  void
+  compile(const string_v& includes, const string_v& excludes);
+
+  // true if the path is monitored
+  bool
+  isValid(const std::string& path) const;
+
+  // true if no path below dir (ending with '/') can be monitored
+  bool
+  isExcludedTree(const std::string& dir) const;
+
+private:
+  enum kind { exact, prefix, suffix, infix, glob };
+
+  struct pattern {
+    kind        type;
+    std::string glob;     // the original pattern
+    std::string literal;  // the part, a matching path must contain
+  };
+
+  typedef std::vector<pattern> pattern_v;
+
+  static pattern
+  compile(const std::string& text);
+
+  static bool
+  match(const pattern_v& patterns, const std::set<std::string>& exacts,
+	const std::string& path);
+
+  pattern_v             _M_Includes;
+  pattern_v             _M_Excludes;
+  std::set<std::string> _M_ExactIncludes;
+  std::set<std::string> _M_ExactExcludes;
+  string_v              _M_TreeExcludes;    // excludes "X*" as X
+  string_v              _M_IncludePrefixes; // literal starts of includes
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
@@ -0,0 +1,105 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "nmstl/ntime"
+
+
+/*
+  A token bucket limiting the bytes per second of a connection, a
+  watchpoint or an import. A rate of 0 means unlimited. The bucket
+  holds the tokens of one second at most and may run into debt, so a
+  message larger than the rate is delayed, but never starved.
+*/
+class TokenBucket
+{
+public:
+  TokenBucket(size_t rate = 0)
+  { set_rate(rate); }
+
+  void
+  set_rate(size_t rate)
+  {
+    _M_Rate   = rate;
+    _M_Tokens = rate;
+    _M_Last   = nmstl::ntime::now();
+  }
+
+  size_t
+  rate() const
+  { return _M_Rate; }
+
+  // the usecs until the next message may be sent
+  long long
+  delay()
+  {
+    if (! _M_Rate)
+      return 0;
+
+    refill();
+    if (_M_Tokens > 0)
+      return 0;
+
+    return (1 - _M_Tokens) * 1000000LL / _M_Rate + 1;
+  }
+
+  void
+  take(size_t bytes)
+  {
+    if (_M_Rate)
+      _M_Tokens -= bytes;
+  }
+
+private:
+  void
+  refill()
+  {
+    nmstl::ntime now = nmstl::ntime::now();
+    long long usecs = (now - _M_Last).to_usecs();
+    long long tokens = usecs * _M_Rate / 1000000LL;
+    if (tokens <= 0)
+      return;
+
+    if (_M_Tokens + tokens >= (long long)_M_Rate) {
+      _M_Tokens = _M_Rate;
+      _M_Last   = now;
+      return;
+    }
+
+    // advance only by the time the tokens are worth
+    _M_Tokens += tokens;
+    _M_Last   += nmstl::ntime::usecs(tokens * 1000000LL / _M_Rate);
+  }
+
+  size_t       _M_Rate;
+  long long    _M_Tokens;
+  nmstl::ntime _M_Last;
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
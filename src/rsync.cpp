@@ -22,7 +22,10 @@
 #include "logging.h"
 #include "rsync.h"
 #include "configfile.h"
+#include "metrics.h"
 #include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
 extern "C" {
 #include <librsync.h>
 
@@ -40,6 +43,21 @@ rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
 using namespace std;
 using namespace nmstl;
 
+// librsync's default file buffers are small, read and write in large chunks
+static const size_t file_buflen = 256 * 1024;
+
+static
+FILE*
+open_sequential(const string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file) {
+    setvbuf(file, 0, _IOFBF, file_buflen);
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return file;
+}
+
 static
 string 
 get_file_name(const string& path) 
@@ -54,12 +72,28 @@ get_file_name(const string& path)
 
 struct send_buf
 {
-  char                 buffer[MAX_COPY_SIZE];
+  char*                buffer;
+  size_t               size;   // the frame size of the connection
   ConnectedWatchPoint* wp;
+  WriteWaiter*         dialog; // woken, when the connection is writable
   unsigned int         message;
 };
 
 
+static void
+init_send_buf(send_buf& sb, ConnectedWatchPoint& wp, WriteWaiter* dialog,
+	      unsigned int message)
+{
+  sb.wp      = &wp;
+  sb.dialog  = dialog;
+  sb.message = message;
+  if (! sb.buffer) {
+    sb.size   = wp.max_frame();
+    sb.buffer = new char[sb.size];
+  }
+}
+
+
 static
 rs_result 
 rs_outnetbuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
@@ -72,13 +106,13 @@ rs_outnetbuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
   if (buf->next_out == NULL) {
     assert(buf->avail_out == 0);
     buf->next_out  = sb->buffer;
-    buf->avail_out = sizeof(sb->buffer);
+    buf->avail_out = sb->size;
     return RS_DONE;
   }
         
-  assert(buf->avail_out <= sizeof(sb->buffer));
+  assert(buf->avail_out <= sb->size);
   assert(buf->next_out >= sb->buffer);
-  assert(buf->next_out <= sb->buffer + sizeof(sb->buffer));
+  assert(buf->next_out <= sb->buffer + sb->size);
 
   present = buf->next_out - sb->buffer;
   if (present > 0) {
@@ -89,9 +123,9 @@ rs_outnetbuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
     sb->wp->write(fex_header(sb->message), constbuf(sb->buffer, present));
 
     buf->next_out  = sb->buffer;
-    buf->avail_out = sizeof(sb->buffer);
+    buf->avail_out = sb->size;
 
-    if (sb->wp->write_bytes_pending())
+    if (sb->wp->write_blocked(sb->dialog))
       return RS_BLOCKED;
   }
         
@@ -110,8 +144,22 @@ struct RsyncSendDialog::Context
   FILE*           new_file;
   rs_filebuf_t*   fb;
   send_buf        sb;
+  size_t          matched; // bytes copied from base_file
 };
 
+
+// rs_file_copy_cb, which counts the bytes taken from the old file
+static
+rs_result
+copy_counted(void* arg, rs_long_t pos, size_t* len, void** buf)
+{
+  RsyncSendDialog::Context* context = (RsyncSendDialog::Context*)arg;
+  rs_result result = rs_file_copy_cb(context->base_file, pos, len, buf);
+  if (result == RS_DONE)
+    context->matched += *len;
+  return result;
+}
+
 static 
 void
 clearContext(RsyncSendDialog::Context* context)
@@ -128,10 +176,31 @@ clearContext(RsyncSendDialog::Context* context)
   if (context->fb)
     rs_filebuf_free(context->fb);
 
+  delete[] context->sb.buffer;
+
   memset(context, 0, sizeof(*context));
 }
 
 
+static
+string
+dir_name(const string& path)
+{
+  size_t pos = path.rfind('/');
+  return pos ? path.substr(0, pos) : string("/");
+}
+
+static
+string
+staging_name(const string& path, const void* owner)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/.fextmp-%i-%lx", 
+	   (int)getpid(), (unsigned long)owner);
+  return dir_name(path) + name;
+}
+
+
 RsyncSendDialog::
 RsyncSendDialog(ConnectedWatchPoint& wp, 
 		const string& file, 
@@ -150,8 +219,8 @@ RsyncSendDialog::
   clearContext(_M_Context);
   delete _M_Context;
 
-  string tmp2(parent().wp()->tmp_dir() + get_file_name(_M_File) + "trans");
-  ::unlink(tmp2.c_str());
+  if (! _M_Staged.empty())
+    ::unlink(_M_Staged.c_str());
 }
 
 void RsyncSendDialog::
@@ -194,6 +263,53 @@ incoming_message(const fex_header &head, constbuf buf)
   ConnectedWatchPoint::Dialog::incoming_message(head, buf);
 }
 
+bool RsyncSendDialog::
+replaceFile()
+{
+  WatchPoint* wp = parent().wp();
+  string target(wp->path() + _M_File);
+  int fd = fileno(_M_Context->new_file);
+
+  if (fflush(_M_Context->new_file) != 0) {
+    lc.error("could not write %s (%s)", target.c_str(), strerror(errno));
+    return false;
+  }
+
+  // the attributes are set before the file becomes visible
+  wp->changeAccess(fd, _M_State);
+
+  if (_M_Staged.empty()) {
+    // give the anonymous O_TMPFILE a name next to the target
+    char proc[32];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%i", fd);
+    _M_Staged = staging_name(target, this);
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, _M_Staged.c_str(), 
+	       AT_SYMLINK_FOLLOW) < 0) {
+      lc.error("could not link %s (%s)", target.c_str(), strerror(errno));
+      _M_Staged.clear();
+      return false;
+    }
+  }
+
+  if (::rename(_M_Staged.c_str(), target.c_str()) < 0) {
+    // only a directory in the way is removed, on any other error the
+    // target stays
+    if (errno != EISDIR && errno != ENOTEMPTY && errno != EEXIST) {
+      lc.error("could not replace %s (%s)", target.c_str(), strerror(errno));
+      return false;
+    }
+
+    wp->remove(_M_File);
+    if (::rename(_M_Staged.c_str(), target.c_str()) < 0) {
+      lc.error("could not replace %s (%s)", target.c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  _M_Staged.clear();
+  return true;
+}
+
 void RsyncSendDialog::
 patchFile(constbuf buf)
 {
@@ -202,7 +318,6 @@ patchFile(constbuf buf)
 
   if (! _M_Context->job) {
     string tmp1(parent().wp()->path() + _M_File);
-    string tmp2(parent().wp()->tmp_dir() + get_file_name(_M_File) + "trans");
 
     _M_Context->base_file = fopen(tmp1.c_str(), "rb");
     if (! _M_Context->base_file) {
@@ -212,7 +327,28 @@ patchFile(constbuf buf)
       return;
     }
 
-    _M_Context->new_file = fopen(tmp2.c_str(), "wb");
+    /* 
+       The new file is staged in the directory of the target, so it
+       can replace the target by one rename. Without O_TMPFILE it gets
+       a unique .fextmp name, which is ignored by the watchpoint.
+    */
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = ::open(dir_name(tmp1).c_str(), O_TMPFILE | O_WRONLY, 0600);
+#endif
+    if (fd < 0) {
+      _M_Staged = staging_name(tmp1, this);
+      fd = ::open(_M_Staged.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
+      if (fd < 0)
+	_M_Staged.clear();
+    }
+
+    if (fd >= 0) {
+      _M_Context->new_file = fdopen(fd, "wb");
+      if (! _M_Context->new_file)
+	::close(fd);
+    }
+
     if (! _M_Context->new_file) {
       lc.error("Could not open new_file %s for rsync(%s) ", 
 	       _M_File.c_str(), strerror(errno));
@@ -220,10 +356,8 @@ patchFile(constbuf buf)
       return;
     }
 
-    _M_Context->fb  = rs_filebuf_new(_M_Context->new_file, 
-				     rs_outbuflen);
-    _M_Context->job = rs_patch_begin(rs_file_copy_cb, 
-				     _M_Context->base_file);
+    _M_Context->fb  = rs_filebuf_new(_M_Context->new_file, file_buflen);
+    _M_Context->job = rs_patch_begin(copy_counted, _M_Context);
     memset(&_M_Context->rsbuf, 0, sizeof(_M_Context->rsbuf));
   }
 
@@ -255,14 +389,15 @@ patchFile(constbuf buf)
   while(_M_Context->result != RS_DONE);
   
   if (buf.length() == 0) {
-    clearContext(_M_Context);
+    size_t size = ftell(_M_Context->new_file);
+    Metrics::get().rsync_patched(size - min(size, _M_Context->matched), 
+				 _M_Context->matched);
 
-    string tmp1 = parent().wp()->tmp_dir() + get_file_name(_M_File) + "trans";
-    string tmp2 = parent().wp()->path() + _M_File;
-    parent().wp()->remove(_M_File);
-    ::rename(tmp1.c_str(), tmp2.c_str());
-    parent().wp()->changeAccess(_M_File, _M_State);
-    lc.info("rsynched file to: %s", tmp2.c_str());
+    if (replaceFile())
+      lc.info("rsynched file to: %s", 
+	      (parent().wp()->path() + _M_File).c_str());
+
+    clearContext(_M_Context);
     endDialog();
   }
 }
@@ -272,14 +407,13 @@ sendSigsBegin()
 {
   string tmp(parent().wp()->path() + _M_File);
 
-  _M_Context->sb.wp      = &parent();
-  _M_Context->sb.message = ME_RsyncSigBlock;
-  _M_Context->base_file = fopen(tmp.c_str(), "rb");
+  init_send_buf(_M_Context->sb, parent(), this, ME_RsyncSigBlock);
+  _M_Context->base_file = open_sequential(tmp);
 
     if (! _M_Context->base_file) {
       int fd = ::open(tmp.c_str(), O_CREAT|O_APPEND);
       ::close(fd);
-      _M_Context->base_file = fopen(tmp.c_str(), "rb");
+      _M_Context->base_file = open_sequential(tmp);
     }
 
   if (! _M_Context->base_file) {
@@ -290,7 +424,7 @@ sendSigsBegin()
   }
 
   _M_Context->job = rs_sig_begin(RS_DEFAULT_BLOCK_LEN, RS_DEFAULT_STRONG_LEN);
-  _M_Context->fb  = rs_filebuf_new(_M_Context->base_file, rs_inbuflen);
+  _M_Context->fb  = rs_filebuf_new(_M_Context->base_file, file_buflen);
   parent().write(fex_header(ME_RsyncStart), constbuf(_M_File));  
   sendSigsIter();
 }
@@ -348,6 +482,8 @@ clearContext(RsyncReceiveDialog::Context* context)
   if (context->fb)
     rs_filebuf_free(context->fb);
 
+  delete[] context->sb.buffer;
+
   memset(context, 0, sizeof(*context));
 }
 
@@ -458,7 +594,7 @@ deltaFileBegin()
     return;
   }
 
-  _M_Context->src_file = fopen(tmp.c_str(), "rb");
+  _M_Context->src_file = open_sequential(tmp);
   if (! _M_Context->src_file) {
     lc.error("Could not open src_file %s for rsync (%s)",
 	     _M_File.c_str(),
@@ -468,11 +604,10 @@ deltaFileBegin()
     return;
   }
 
-  _M_Context->sb.wp      = &parent();
-  _M_Context->sb.message = ME_RsyncDeltaBlock;
+  init_send_buf(_M_Context->sb, parent(), this, ME_RsyncDeltaBlock);
 
   _M_Context->job = rs_delta_begin(_M_Context->sumset);
-  _M_Context->fb  = rs_filebuf_new(_M_Context->src_file, rs_inbuflen);
+  _M_Context->fb  = rs_filebuf_new(_M_Context->src_file, file_buflen);
   deltaFileIter();
 }
 
@@ -59,10 +59,14 @@ private:
 
   void
   patchFile(nmstl::constbuf buf);
+
+  bool
+  replaceFile();
  
   Context*    _M_Context;
   State       _M_State;
   std::string _M_File;
+  std::string _M_Staged; // name of the patched file until it is renamed
 };
 
 
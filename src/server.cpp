@@ -60,6 +60,7 @@ incoming_message(const fex_header &head, constbuf buf)
     return;
 
   case ME_FullSyncComplete:
+    parent().synchronized();
     endDialog();
     return;
 
@@ -0,0 +1,462 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "logging.h"
+#include "config.h"
+#include "tls.h"
+#include <fstream>
+
+using namespace std;
+using namespace nmstl;
+
+
+mutex                       TlsTransport::_S_TrustLock;
+TlsTransport::fingerprint_s TlsTransport::_S_Trusted;
+TlsTransport::fingerprint_v TlsTransport::_S_Unsaved;
+string                      TlsTransport::_S_TrustFile;
+string                      TlsTransport::_S_Certificate;
+bool                        TlsTransport::_S_AcceptNew = false;
+
+
+void TlsTransport::
+setup(const string& certificate, const string& trustfile, bool accept_new)
+{
+  // the same trust as for ssh keys (see ssh_add_key)
+  fingerprint_s trusted;
+  ifstream in(trustfile.c_str());
+  while(in.good()) {
+    char buffer[1024];
+    if (! in.getline(buffer, sizeof(buffer)).good())
+      break;
+
+    trusted.insert(buffer);
+  }
+  in.close();
+
+  locking(_S_TrustLock) {
+    if (_S_Certificate.empty())
+      _S_Certificate = certificate;
+
+    // not yet saved fingerprints stay trusted
+    trusted.insert(_S_Unsaved.begin(), _S_Unsaved.end());
+    _S_Trusted.swap(trusted);
+    _S_TrustFile = trustfile;
+    _S_AcceptNew = accept_new;
+  }
+}
+
+void TlsTransport::
+saveTrusted()
+{
+  fingerprint_v unsaved;
+  string        trustfile;
+  locking(_S_TrustLock) {
+    unsaved.swap(_S_Unsaved);
+    trustfile = _S_TrustFile;
+  }
+
+  if (unsaved.empty())
+    return;
+
+  ofstream out(trustfile.c_str(), ios_base::out|ios_base::app);
+  fingerprint_v::iterator i;
+  for(i = unsaved.begin(); i != unsaved.end(); i++)
+    out << *i << endl;
+
+  if (! out.good())
+    lc.error("cannot write %s", trustfile.c_str());
+}
+
+// called by the network threads
+bool TlsTransport::
+trust(const string& fingerprint)
+{
+  locking(_S_TrustLock) {
+    if (_S_Trusted.count(fingerprint))
+      return true;
+
+    if (! _S_AcceptNew)
+      return false;
+
+    _S_Trusted.insert(fingerprint);
+    _S_Unsaved.push_back(fingerprint);
+  }
+
+  lc.notice("trust new tls peer %s", fingerprint.c_str());
+  return true;
+}
+
+
+#ifdef HAVE_LIBSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+enum {
+  // the validity of a created certificate
+  certificate_days = 3650,
+
+  // the plain text decoded at once
+  read_chunk = 16384
+};
+
+static const char* cipher_suites =
+  "TLS_AES_128_GCM_SHA256:"
+  "TLS_CHACHA20_POLY1305_SHA256:"
+  "TLS_AES_256_GCM_SHA384";
+
+
+static string
+ssl_error()
+{
+  char buffer[256];
+  ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+  return buffer;
+}
+
+// self signed certificates are expected, verifyPeer decides
+static int
+accept_certificate(int ok, X509_STORE_CTX* ctx)
+{
+  return 1;
+}
+
+static bool
+create_certificate(const string& path)
+{
+  EVP_PKEY*     key  = NULL;
+  X509*         cert = NULL;
+  FILE*         out  = NULL;
+  bool          ok   = false;
+  mode_t        mask;
+  char          host[256];
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+
+  if (! kctx
+      || EVP_PKEY_keygen_init(kctx) <= 0
+      || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, 
+						NID_X9_62_prime256v1) <= 0
+      || EVP_PKEY_keygen(kctx, &key) <= 0)
+    goto done;
+
+  if (gethostname(host, sizeof(host)) != 0)
+    strcpy(host, "fexd");
+  host[sizeof(host) - 1] = 0;
+
+  cert = X509_new();
+  if (! cert)
+    goto done;
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), time(NULL));
+  X509_gmtime_adj(X509_get_notBefore(cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert), 
+		  (long)certificate_days * 24 * 60 * 60);
+  X509_set_pubkey(cert, key);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+			     (const unsigned char*)host, -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(cert));
+  if (! X509_sign(cert, key, EVP_sha256()))
+    goto done;
+
+  mask = umask(077);
+  out = fopen(path.c_str(), "w");
+  umask(mask);
+  if (! out)
+    goto done;
+
+  ok = (PEM_write_PrivateKey(out, key, NULL, NULL, 0, NULL, NULL)
+	&& PEM_write_X509(out, cert));
+  ok = (fclose(out) == 0) && ok;
+
+ done:
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(kctx);
+  return ok;
+}
+
+
+ssl_ctx_st* 
+TlsTransport::
+context()
+{
+  static bool    initialized = false;
+  static SSL_CTX *ctx = NULL;
+
+  if (initialized)
+    return ctx;
+
+  initialized = true;
+
+  string cert_file;
+  locking(_S_TrustLock)
+    cert_file = _S_Certificate;
+
+  if (access(cert_file.c_str(), R_OK) != 0) {
+    if (! create_certificate(cert_file)) {
+      lc.error("cannot create tls certificate %s (%s)", 
+	       cert_file.c_str(), ssl_error().c_str());
+      return NULL;
+    }
+
+    lc.notice("created tls certificate %s", cert_file.c_str());
+  }
+
+  ctx = SSL_CTX_new(TLS_method());
+  if (! ctx
+      || ! SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION)
+      || ! SSL_CTX_set_ciphersuites(ctx, cipher_suites)
+      || SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+      || SSL_CTX_use_PrivateKey_file(ctx, cert_file.c_str(), 
+				     SSL_FILETYPE_PEM) != 1) {
+    lc.error("cannot initialize tls (%s)", ssl_error().c_str());
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return NULL;
+  }
+
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+		     accept_certificate);
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+  return ctx;
+}
+
+bool 
+TlsTransport::
+available()
+{
+  return context() != NULL;
+}
+
+
+TlsTransport::
+TlsTransport(bool server)
+  : _M_SSL(NULL), _M_In(NULL), _M_Out(NULL), 
+    _M_Server(server), _M_Ready(false)
+{
+}
+
+TlsTransport::
+~TlsTransport()
+{
+  // frees the bios too
+  SSL_free(_M_SSL);
+}
+
+bool TlsTransport::
+start()
+{
+  SSL_CTX* ctx = context();
+  if (! ctx)
+    return false;
+
+  _M_SSL = SSL_new(ctx);
+  _M_In  = BIO_new(BIO_s_mem());
+  _M_Out = BIO_new(BIO_s_mem());
+  if (! _M_SSL || ! _M_In || ! _M_Out) {
+    lc.error("cannot start tls (%s)", ssl_error().c_str());
+    return false;
+  }
+
+  SSL_set_bio(_M_SSL, _M_In, _M_Out);
+
+  if (_M_Server) {
+    SSL_set_accept_state(_M_SSL);
+    return true;
+  }
+
+  // the client hello
+  SSL_set_connect_state(_M_SSL);
+  return handshake();
+}
+
+bool TlsTransport::
+encode(constbuf plain)
+{
+  if (! _M_Ready) {
+    _M_Held.append(plain.data(), plain.length());
+    return true;
+  }
+
+  if (! plain.length())
+    return true;
+
+  // the memory bio takes everything at once
+  int result = SSL_write(_M_SSL, plain.data(), plain.length());
+  return result > 0 || failed(result, "write");
+}
+
+bool TlsTransport::
+decode(constbuf raw, string& plain)
+{
+  if (BIO_write(_M_In, raw.data(), raw.length()) != (int)raw.length())
+    return false;
+
+  if (! _M_Ready && ! handshake())
+    return false;
+
+  char buffer[read_chunk];
+  while(_M_Ready) {
+    int result = SSL_read(_M_SSL, buffer, sizeof(buffer));
+    if (result <= 0)
+      return failed(result, "read");
+
+    plain.append(buffer, result);
+  }
+
+  return true;
+}
+
+void TlsTransport::
+output(string& raw)
+{
+  char* data;
+  long  length = BIO_get_mem_data(_M_Out, &data);
+  if (length > 0) {
+    raw.append(data, length);
+    (void)BIO_reset(_M_Out);
+  }
+}
+
+bool TlsTransport::
+handshake()
+{
+  int result = SSL_do_handshake(_M_SSL);
+  if (result != 1)
+    return failed(result, "handshake");
+
+  if (! verifyPeer())
+    return false;
+
+  _M_Ready = true;
+  lc.info("tls connection with %s", SSL_get_cipher_name(_M_SSL));
+
+  string held;
+  held.swap(_M_Held);
+  return encode(constbuf(held));
+}
+
+bool TlsTransport::
+verifyPeer()
+{
+  X509* cert = SSL_get_peer_certificate(_M_SSL);
+  if (! cert) {
+    lc.notice("tls peer without certificate");
+    return false;
+  }
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int  length = 0;
+  bool          ok = X509_digest(cert, EVP_sha256(), digest, &length);
+  X509_free(cert);
+
+  if (! ok)
+    return false;
+
+  string fingerprint;
+  for(unsigned int i = 0; i < length; i++) {
+    char hex[4];
+    snprintf(hex, sizeof(hex), i ? ":%02X" : "%02X", digest[i]);
+    fingerprint += hex;
+  }
+
+  if (trust(fingerprint))
+    return true;
+
+  lc.notice("tls peer %s is not trusted", fingerprint.c_str());
+  return false;
+}
+
+bool TlsTransport::
+failed(int result, const char* what)
+{
+  switch(SSL_get_error(_M_SSL, result)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    return true;
+
+  case SSL_ERROR_ZERO_RETURN:
+    // the peer closed the session
+    return false;
+  }
+
+  lc.notice("tls %s failed (%s)", what, ssl_error().c_str());
+  return false;
+}
+
+#else
+
+
+bool 
+TlsTransport::
+available()
+{
+  lc.error("fexd was built without tls support");
+  return false;
+}
+
+TlsTransport::
+TlsTransport(bool server)
+  : _M_SSL(NULL), _M_In(NULL), _M_Out(NULL), 
+    _M_Server(server), _M_Ready(false)
+{
+}
+
+TlsTransport::
+~TlsTransport()
+{
+}
+
+bool TlsTransport::
+start()
+{
+  return available();
+}
+
+bool TlsTransport::
+encode(constbuf plain)
+{
+  return false;
+}
+
+bool TlsTransport::
+decode(constbuf raw, string& plain)
+{
+  return false;
+}
+
+void TlsTransport::
+output(string& raw)
+{
+}
+
+#endif
@@ -0,0 +1,125 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef TLS_H
+#define TLS_H
+
+#include "nmstl/netioevent"
+#include "nmstl/thread"
+#include <string>
+#include <set>
+#include <vector>
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct bio_st;
+
+
+/*
+  The TLS 1.3 layer of a Connection. Both peers own a self signed
+  certificate (see tls_certificate). Like the ssh keys of ME_ClientKey,
+  the certificate of an unknown peer is trusted at the first contact,
+  if accept_keys is set. Otherwise its fingerprint must be listed in
+  the file FEX_STATE/tls_trusted.
+
+  The transport works on memory buffers, so it can move with its
+  socket to a network thread. The trusted fingerprints are therefore
+  loaded by the MainLoop (setup) and guarded by a mutex, newly trusted
+  ones are appended to the file by the MainLoop too (saveTrusted).
+*/
+class TlsTransport : public nmstl::transport
+{
+public:
+  // called by the Configuration at each (re)load; the certificate is
+  // taken at the first call only
+  static void
+  setup(const std::string& certificate, const std::string& trustfile,
+	bool accept_new);
+
+  // appends the fingerprints trusted since the last call to the trustfile
+  static void
+  saveTrusted();
+
+  // loads (or creates) the certificate at the first call; false if
+  // fexd cannot use TLS
+  static bool
+  available();
+
+  TlsTransport(bool server);
+  virtual ~TlsTransport();
+
+  virtual bool
+  start();
+
+  virtual bool
+  encode(nmstl::constbuf plain);
+
+  virtual bool
+  decode(nmstl::constbuf raw, std::string& plain);
+
+  virtual void
+  output(std::string& raw);
+
+  virtual size_t
+  pending() const
+  { return _M_Held.size(); }
+
+private:
+  static ssl_ctx_st*
+  context();
+
+  bool
+  handshake();
+
+  bool
+  verifyPeer();
+
+  bool
+  failed(int result, const char* what);
+
+  static bool
+  trust(const std::string& fingerprint);
+
+  typedef std::set<std::string>    fingerprint_s;
+  typedef std::vector<std::string> fingerprint_v;
+
+  static nmstl::mutex  _S_TrustLock;
+  static fingerprint_s _S_Trusted;
+  static fingerprint_v _S_Unsaved;
+  static std::string   _S_TrustFile;
+  static std::string   _S_Certificate;
+  static bool          _S_AcceptNew;
+
+  ssl_st*     _M_SSL;
+  bio_st*     _M_In;
+  bio_st*     _M_Out;
+  bool        _M_Server;
+  bool        _M_Ready;
+  std::string _M_Held;  // written before the handshake was done
+};
+
+#endif
+
+/** EMACS **
+ * Local variables:
+ * mode: c++
+ * End:
+ */
@@ -0,0 +1,139 @@
+/***************************************************************************
+ *   Copyright (C) 2004 by Michael Reithinger                              *
+ *   mreithinger@web.de                                                    *
+ *                                                                         *
+ *   This file is part of fex.                                             *
+ *                                                                         *
+ *   fex is free software; you can redistribute it and/or modify           *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   fex is distributed in the hope that it will be useful,                *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+  A loopback check of the TLS transport (make check): two transports
+  talk through memory, without sockets and without a running fexd.
+*/
+#include "logging.h"
+#include "config.h"
+#include "tls.h"
+#include <fstream>
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace nmstl;
+
+log4cpp::Category& lc = log4cpp::Category::getRoot();
+
+
+// moves the output of from to to; false if to rejects it
+static bool
+pump(TlsTransport& from, TlsTransport& to, string& plain)
+{
+  string raw;
+  from.output(raw);
+  return raw.empty() || to.decode(constbuf(raw), plain);
+}
+
+// true if client and server exchange a message in both directions
+static bool
+exchange()
+{
+  TlsTransport client(false);
+  TlsTransport server(true);
+  if (! server.start() || ! client.start())
+    return false;
+
+  string to_server = "hello server";
+  string to_client = "hello client";
+  if (! client.encode(constbuf(to_server)) 
+      || ! server.encode(constbuf(to_client)))
+    return false;
+
+  string at_server;
+  string at_client;
+  for(int i = 0; i < 10; i++) {
+    if (! pump(client, server, at_server) || ! pump(server, client, at_client))
+      return false;
+  }
+
+  return at_server == to_server && at_client == to_client;
+}
+
+static size_t
+count_lines(const string& path)
+{
+  size_t   lines = 0;
+  ifstream in(path.c_str());
+  string   line;
+  while(getline(in, line))
+    lines++;
+
+  return lines;
+}
+
+static int
+check(bool ok, const char* what)
+{
+  cout << (ok ? "PASS: " : "FAIL: ") << what << endl;
+  return ok ? 0 : 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+  char dir[] = "/tmp/fex-tls-XXXXXX";
+  if (! mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  string certificate = string(dir) + "/tls.pem";
+  string trustfile   = string(dir) + "/tls_trusted";
+  int    failures    = 0;
+
+#ifndef HAVE_LIBSSL
+  // fexd without tls must refuse it
+  TlsTransport::setup(certificate, trustfile, true);
+  failures += check(! TlsTransport::available(), "tls is unavailable");
+#else
+  // the first contact, both sides have the same certificate
+  struct stat st;
+  mode_t      mask = umask(022);
+  TlsTransport::setup(certificate, trustfile, true);
+  failures += check(TlsTransport::available(), "certificate is created");
+  failures += check(stat(certificate.c_str(), &st) == 0 
+		    && ! (st.st_mode & 077), "certificate is private");
+  failures += check(umask(mask) == 022, "umask is restored");
+  failures += check(exchange(), "unknown peer is accepted");
+
+  TlsTransport::saveTrusted();
+  failures += check(count_lines(trustfile) == 1, "peer is written down");
+
+  // a reload reads the trusted peers again
+  TlsTransport::setup(certificate, trustfile, false);
+  failures += check(exchange(), "trusted peer is accepted");
+
+  unlink(trustfile.c_str());
+  TlsTransport::setup(certificate, trustfile, false);
+  failures += check(! exchange(), "unknown peer is refused");
+  failures += check(count_lines(trustfile) == 0, "refused peer is not saved");
+#endif
+
+  unlink(trustfile.c_str());
+  unlink(certificate.c_str());
+  rmdir(dir);
+  return failures ? 1 : 0;
+}
@@ -25,6 +25,7 @@
 #include "configfile.h"
 #include "server.h"
 #include "client.h"
+#include "metrics.h"
 
 using namespace std;
 using namespace nmstl;
@@ -33,7 +34,7 @@ ConnectedWatchPoint::
 ConnectedWatchPoint(io_event_loop& loop, 
 		    WatchPoint* wp, 
 		    Connection* con,
-		    unsigned char id)
+		    size_t id)
   : timer(loop)
 {
   assert(wp != NULL);
@@ -44,6 +45,10 @@ ConnectedWatchPoint(io_event_loop& loop,
   _M_WriteLog    = &_M_Log[0];
   _M_SendLog     = &_M_Log[1];
   _M_PendingSync = false;
+  _M_SendSeq     = 0;
+  _M_SessionSeq  = 0;
+  _M_WriteSince  = ntime::none();
+  _M_SendSince   = ntime::none();
   _M_WatchPoint->connect(this);
 }
 
@@ -98,10 +103,105 @@ startSync()
     _M_SendLog  = &_M_Log[1];
   }
 
+  _M_SendSince  = _M_WriteSince;
+  _M_WriteSince = ntime::none();
+
+  _M_SendSeq = wp()->journal().last();
   pushSendDialog();
   _M_PendingSync = false;
 }
 
+void ConnectedWatchPoint::
+startFullSync()
+{
+  _M_SessionSeq = wp()->journal().last();
+  pushDialog(new client::FullSyncDialog(*this));
+  _M_Mode = MO_fullsynched;
+}
+
+void ConnectedWatchPoint::
+syncAcknowledged()
+{
+  if (! _M_Peer.empty())
+    wp()->journal().acknowledge(_M_Peer, _M_SendSeq);
+
+  if (_M_SendSince)
+    Metrics::get().sync_latency(wp()->path(), 
+				(ntime::now() - _M_SendSince).to_usecs() 
+				/ 1000000.0);
+  _M_SendSince = ntime::none();
+}
+
+void ConnectedWatchPoint::
+synchronized()
+{
+  if (! _M_Peer.empty())
+    wp()->journal().begin(_M_Peer, _M_PeerEpoch, _M_SessionSeq);
+}
+
+void ConnectedWatchPoint::
+requestResume()
+{
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0)
+    host[0] = 0;
+  host[sizeof(host) - 1] = 0;
+
+  ChangeJournal& journal = wp()->journal();
+  string known = journal.peer_epoch(_M_Peer);
+  int    ready = journal.resumable(_M_Peer, known);
+
+  omessage msg;
+  msg << string(host) + ':' + wp()->path() << ChangeJournal::epoch() 
+      << known << ready;
+  write(fex_header(ME_Resume), msg);
+}
+
+void ConnectedWatchPoint::
+resumed(constbuf buf, bool ok)
+{
+  imessage msg(buf);
+  msg >> _M_PeerEpoch;
+
+  if (! ok) {
+    startFullSync();
+    return;
+  }
+
+  lc.notice("session with %s resumed", _M_Peer.c_str());
+  wp()->journal().replay(_M_Peer, *this);
+  _M_Mode = MO_fullsynched;
+  requireSync();
+}
+
+void ConnectedWatchPoint::
+resume(constbuf buf)
+{
+  string known;
+  int    ready = 0;
+
+  imessage msg(buf);
+  msg >> _M_Peer >> _M_PeerEpoch >> known >> ready;
+
+  ChangeJournal& journal = wp()->journal();
+  omessage answer;
+  answer << ChangeJournal::epoch();
+
+  // both journals must hold the changes, the other side missed
+  if (! ready 
+      || known != ChangeJournal::epoch()
+      || ! journal.resumable(_M_Peer, _M_PeerEpoch)) {
+    write(fex_header(ME_ResumeFail), answer);
+    return;
+  }
+
+  write(fex_header(ME_ResumeOk), answer);
+  lc.notice("session with %s resumed", _M_Peer.c_str());
+  journal.replay(_M_Peer, *this);
+  _M_Mode = MO_fullsynched;
+  requireSync();
+}
+
 void ConnectedWatchPoint::
 requireSync()
 {
@@ -155,6 +255,7 @@ incoming_message(const fex_header &head, constbuf buf)
   if (_M_DialogStack.empty()) {
     switch(head.type) {
     case ME_FullSyncStart:
+      _M_SessionSeq = wp()->journal().last();
       pushDialog(new server::FullSyncDialog(*this), head, buf);
       _M_Mode = MO_fullsynched;
       break;
@@ -168,8 +269,22 @@ incoming_message(const fex_header &head, constbuf buf)
       break;
 
     case ME_Accept:
-      pushDialog(new client::FullSyncDialog(*this));
-      _M_Mode = MO_fullsynched;
+      if (_M_Connection->resumable())
+	requestResume();
+      else
+	startFullSync();
+      break;
+
+    case ME_Resume:
+      resume(buf);
+      break;
+
+    case ME_ResumeOk:
+      resumed(buf, true);
+      break;
+
+    case ME_ResumeFail:
+      resumed(buf, false);
       break;
     }
   }
@@ -212,6 +327,9 @@ addToLog(const string& key,
     org.action = action;
   }
 
+  if (! _M_WriteSince)
+    _M_WriteSince = ntime::now();
+
   if (do_sync)
     requireSync();
 }
@@ -236,6 +354,10 @@ undoSync()
 {
   _M_WriteLog->insert(_M_SendLog->begin(), _M_SendLog->end());
   _M_SendLog->clear();
+
+  if (_M_SendSince)
+    _M_WriteSince = _M_SendSince;
+  _M_SendSince = ntime::none();
   requireSync();
 }
 
@@ -309,11 +431,15 @@ ClientWatchPoint::
 ClientWatchPoint(nmstl::io_event_loop& loop, 
 		 WatchPoint* wp,
 		 Connection* con,
-		 unsigned char id, 
-		 IDTranslator* translator)
+		 size_t id, 
+		 IDTranslator* translator,
+		 const string& peer,
+		 size_t rate_limit)
   : ConnectedWatchPoint(loop, wp, con, id)
 {
   _M_Translator = translator;
+  _M_Peer       = peer;
+  _M_Limit.set_rate(rate_limit);
 }
 
 
@@ -347,15 +473,13 @@ void ClientWatchPoint::
 translateReceivedState(State& state)
 { 
   assert(_M_Translator != NULL);
-  state.uid = _M_Translator->getClientUid(state.uid);
-  state.gid = _M_Translator->getClientGid(state.gid);
+  _M_Translator->toClient(state);
 }
 
 void ClientWatchPoint::
 translateSendState(State& state)
 { 
   assert(_M_Translator != NULL);
-  state.uid = _M_Translator->getServerUid(state.uid);
-  state.gid = _M_Translator->getServerGid(state.gid);
+  _M_Translator->toServer(state);
 }
 
@@ -44,7 +44,7 @@ public:
   ConnectedWatchPoint(nmstl::io_event_loop& loop, 
 		      WatchPoint* wp,
 		      Connection* con,
-		      unsigned char id = 0);
+		      size_t id = 0);
   virtual ~ConnectedWatchPoint();
 
 
@@ -61,6 +61,16 @@ public:
   write_bytes_pending() const
   { return _M_Connection->write_bytes_pending(); }
 
+  // like write_bytes_pending, but if true, waiter is woken as soon
+  // as the connection takes data again
+  bool
+  write_blocked(WriteWaiter* waiter) const
+  { return _M_Connection->write_blocked(waiter); }
+
+  size_t
+  max_frame() const
+  { return _M_Connection->max_frame(); }
+
   void 
   disconnect()
   { _M_Connection->set_socket(nmstl::tcpsocket()); }
@@ -69,6 +79,11 @@ public:
   wp() const
   { return _M_WatchPoint; }
 
+  // the limit of this connection to the watchpoint (see import)
+  TokenBucket&
+  limit()
+  { return _M_Limit; }
+
   void 
   file_changed(const std::string& key, 
 	       const State& state, 
@@ -136,6 +151,33 @@ public:
   receiveWriteLog(nmstl::constbuf buf)
   { receiveLog(buf, _M_WriteLog); }
 
+  // the identity of the peer in the ChangeJournal
+  const std::string&
+  peer() const
+  { return _M_Peer; }
+
+  // the peer has all changes sent by the last synchronisation
+  void
+  syncAcknowledged();
+
+  // the full synchronisation with the peer is complete
+  void
+  synchronized();
+
+  size_t
+  dialog_depth() const
+  { return _M_DialogStack.size(); }
+
+  // the changes not yet acknowledged by the peer
+  size_t
+  pending() const
+  { return _M_Log[0].size() + _M_Log[1].size(); }
+
+  // when the oldest of them was logged (ntime::none() if there is none)
+  nmstl::ntime
+  pending_since() const
+  { return _M_SendSince ? _M_SendSince : _M_WriteSince; }
+
 protected:
   typedef std::vector<Dialog*> Dialog_v;
 
@@ -149,18 +191,41 @@ protected:
 
   WatchPoint*   _M_WatchPoint;
   Connection*   _M_Connection;
-  unsigned char _M_Id;
+  size_t        _M_Id;
   Dialog_v      _M_DialogStack;
   int           _M_Mode;
+  TokenBucket   _M_Limit;
+  std::string   _M_Peer;
+  std::string   _M_PeerEpoch;
 
 private:
   void
   startSync();
 
+  void
+  startFullSync();
+
+  // client side of ME_Resume
+  void
+  requestResume();
+
+  void
+  resumed(nmstl::constbuf buf, bool ok);
+
+  // server side of ME_Resume
+  void
+  resume(nmstl::constbuf buf);
+
   ModLog   _M_Log[2];
   bool     _M_PendingSync;
   ModLog*  _M_WriteLog;
   ModLog*  _M_SendLog;
+
+  ChangeJournal::seq_t _M_SendSeq;     // the last change in _M_SendLog
+  ChangeJournal::seq_t _M_SessionSeq;  // the last change before full sync
+
+  nmstl::ntime _M_WriteSince; // the first change in _M_WriteLog
+  nmstl::ntime _M_SendSince;  // the first change in _M_SendLog
 };
 
 
@@ -176,8 +241,10 @@ public:
   ClientWatchPoint(nmstl::io_event_loop& loop, 
 		   WatchPoint* wp,
 		   Connection* con,
-		   unsigned char id, 
-		   IDTranslator* translator);
+		   size_t id, 
+		   IDTranslator* translator,
+		   const std::string& peer,
+		   size_t rate_limit);
   virtual ~ClientWatchPoint();
 
   virtual void
@@ -201,14 +268,16 @@ private:
 
 
 /*
-  The base class of all message dialogs between server an client
+  The base class of all message dialogs between server an client.
+  A dialog blocked by the connection gets an ME_wavail, when it
+  can write again (see write_blocked).
 */
-class ConnectedWatchPoint::Dialog
+class ConnectedWatchPoint::Dialog : public WriteWaiter
 {
 public:
   virtual 
   ~Dialog()
-  { }
+  { _M_WatchPoint._M_Connection->cancel_wait(this); }
   
 protected:
   Dialog(ConnectedWatchPoint& wp)
@@ -242,6 +311,14 @@ protected:
   void endDialog()
   { _M_WatchPoint.popDialog(); }
 
+  bool
+  write_blocked()
+  { return parent().write_blocked(this); }
+
+  virtual void
+  writable()
+  { parent().incoming_message(fex_header(ME_wavail), nmstl::constbuf()); }
+
   bool
   write(const fex_header& head, nmstl::constbuf payload)
   { return parent().write(head, payload); }